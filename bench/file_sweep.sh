@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+#   static file throughput by file size. Writes one file of every size to a
+#   scratch root, starts bin/Server on it and fetches each file with
+#   bin/http_load over keep-alive connections.
+#
+#   make && make bench && ./bench/file_sweep.sh [size]...
+#
+#   sizes take dd suffixes, default 1K 64K 1M 16M 256M 1G. CONNS, REQUESTS
+#   (per size, divided by the size in MB for large files), PORT, BACKEND and
+#   MULTIREACTOR override the defaults below. BACKEND=io_uring MULTIREACTOR=1
+#   sends the files with linked splices on the ring.
+
+CONNS=${CONNS:-4}
+REQUESTS=${REQUESTS:-20000}
+PORT=${PORT:-8867}
+BACKEND=${BACKEND:-epoll}
+MULTIREACTOR=${MULTIREACTOR:-0}
+SIZES=${*:-"1K 64K 1M 16M 256M 1G"}
+
+cd "$(dirname "$0")/.." || exit 1
+
+if [ ! -x bin/Server ] || [ ! -x bin/http_load ]; then
+    echo "build bin/Server and bin/http_load first: make && make bench" >&2
+    exit 1
+fi
+
+root=$(mktemp -d)
+trap 'kill $server 2>/dev/null; rm -rf "$root"' EXIT
+
+for size in $SIZES; do
+    head -c "$size" /dev/urandom > "$root/$size.bin" || exit 1
+done
+
+cat > "$root/httpserver.conf" <<EOF
+root=$root
+port=$PORT
+threadnum=4
+ipaddr=127.0.0.1
+progname=file_sweep
+logdir=$root/log
+loglevel=1
+multireactor=$MULTIREACTOR
+backend=$BACKEND
+EOF
+
+./bin/Server -c "$root/httpserver.conf" > /dev/null &
+server=$!
+sleep 1
+
+printf "%-6s %s\n" size result
+for size in $SIZES; do
+    bytes=$(stat -c %s "$root/$size.bin")
+    n=$((REQUESTS * 1048576 / (bytes + 1048576)))
+    [ $n -lt $CONNS ] && n=$CONNS
+    printf "%-6s " "$size"
+    ./bin/http_load -p "$PORT" -c "$CONNS" -n "$n" "/$size.bin" | sed -n 2p
+done
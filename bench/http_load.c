@@ -0,0 +1,329 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+*   load driver for the server: c keep-alive connections, each with up to
+*   d pipelined GETs of one uri in flight, until n responses are read.
+*   Prints req/s and MB/s of the bodies; with -P the CPU time the server
+*   process spent, from /proc/pid/stat, per request.
+*
+*   ./bin/http_load -p 8866 -c 16 -d 8 -n 64000 -b -P $(pidof Server) /index.html
+*
+*   -b adds the headers of a browser (User-Agent, Accept, Cookie, Sec-Fetch-*).
+*   Responses are framed by Content-length, bodies are read and dropped.
+*/
+
+#define LOAD_BUF            (256 * 1024)
+#define LOAD_REQUEST_MAX    4096
+
+typedef struct load_conn_s {
+    int         fd;
+    int         inflight;       /* requests sent, not answered yet */
+    size_t      body_left;      /* of the response being read */
+    size_t      len;            /* header bytes in buf */
+    char        buf[LOAD_BUF];
+} load_conn_t;
+
+static const char *load_browser_headers =
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Accept-Encoding: identity\r\n"
+    "Accept-Language: en-US,en;q=0.9,zh-CN;q=0.8,zh;q=0.7\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Cookie: session=8f2d4c1a9b7e6f3d2c1b0a9f8e7d6c5b; theme=dark; "
+    "lang=en; _ga=GA1.1.1234567890.1700000000\r\n"
+    "Referer: http://localhost/index.html\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: same-origin\r\n";
+
+static char     load_request[LOAD_REQUEST_MAX];
+static size_t   load_request_len;
+
+static long     load_total;         /* responses wanted */
+static long     load_sent;
+static long     load_done;
+static long     load_errors;
+static uint64_t load_bytes;         /* body bytes */
+
+static double load_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* utime + stime of pid in clock ticks, -1 without /proc */
+static long load_cpu(int pid) {
+    char path[64], buf[1024], *p;
+    unsigned long utime, stime;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    if (fgets(buf, sizeof(buf), fp) == NULL) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    /* the command may hold spaces, fields count from the closing paren */
+    p = strrchr(buf, ')');
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                            &utime, &stime) != 2) {
+        return -1;
+    }
+
+    return (long)(utime + stime);
+}
+
+static int load_connect(struct sockaddr_in *addr) {
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return fd;
+}
+
+/* fill the pipeline of c up to depth, the requests are small enough for one send */
+static int load_send(load_conn_t *c, int depth) {
+    char batch[LOAD_REQUEST_MAX * 16];
+    int n = 0;
+    ssize_t ret;
+
+    while (c->inflight + n < depth && load_sent + n < load_total
+           && (size_t)(n + 1) * load_request_len <= sizeof(batch)) {
+        memcpy(batch + n * load_request_len, load_request, load_request_len);
+        n++;
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+
+    ret = send(c->fd, batch, n * load_request_len, MSG_NOSIGNAL);
+    if (ret != (ssize_t)(n * load_request_len)) {
+        return -1;
+    }
+
+    c->inflight += n;
+    load_sent += n;
+
+    return 0;
+}
+
+/* the responses in the bytes just read, -1 if the server closes or sends garbage */
+static int load_recv(load_conn_t *c) {
+    char *end, *cl;
+    size_t used, hlen;
+    ssize_t n;
+
+    for (;;) {
+        /* one byte for the NUL strstr needs */
+        n = recv(c->fd, c->buf + c->len, LOAD_BUF - 1 - c->len, 0);
+        if (n == 0) {
+            return -1;
+        }
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+
+        c->len += n;
+        used = 0;
+
+        while (used < c->len) {
+            if (c->body_left) {
+                n = c->len - used < c->body_left ? c->len - used : c->body_left;
+                c->body_left -= n;
+                used += n;
+                load_bytes += n;
+                if (c->body_left == 0) {
+                    c->inflight--;
+                    load_done++;
+                }
+                continue;
+            }
+
+            c->buf[c->len] = '\0';
+            end = strstr(c->buf + used, "\r\n\r\n");
+            if (end == NULL) {
+                break;
+            }
+            hlen = end + 4 - (c->buf + used);
+
+            if (strncmp(c->buf + used, "HTTP/1.1 200", 12) != 0) {
+                load_errors++;
+            }
+
+            cl = strcasestr(c->buf + used, "\r\nContent-length:");
+            if (cl == NULL || cl > end) {
+                return -1;
+            }
+            c->body_left = strtoul(cl + sizeof("\r\nContent-length:") - 1, NULL, 10);
+            used += hlen;
+
+            if (c->body_left == 0) {
+                c->inflight--;
+                load_done++;
+            }
+        }
+
+        /* keep the start of a header that is not complete yet */
+        memmove(c->buf, c->buf + used, c->len - used);
+        c->len -= used;
+        if (c->len == LOAD_BUF - 1) {
+            return -1;
+        }
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "http_load [option]... uri\n"
+        "  -a <addr>   server address, default 127.0.0.1\n"
+        "  -p <port>   server port, default 8866\n"
+        "  -c <conns>  connections, default 16\n"
+        "  -d <depth>  pipelined requests per connection, default 1\n"
+        "  -n <num>    responses to read, default 10000\n"
+        "  -b          send the headers of a browser\n"
+        "  -P <pid>    report the CPU time of the server per request\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in addr;
+    struct epoll_event ev, events[256];
+    load_conn_t *conns;
+    const char *ipaddr = "127.0.0.1";
+    int port = 8866, nconn = 16, depth = 1, browser = 0, pid = 0;
+    int opt, epfd, n;
+    long cpu_start = -1, cpu_end;
+    double start, elapsed;
+
+    load_total = 10000;
+
+    while ((opt = getopt(argc, argv, "a:p:c:d:n:bP:h")) != -1) {
+        switch (opt) {
+            case 'a': ipaddr = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': nconn = atoi(optarg); break;
+            case 'd': depth = atoi(optarg); break;
+            case 'n': load_total = atol(optarg); break;
+            case 'b': browser = 1; break;
+            case 'P': pid = atoi(optarg); break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1 || nconn <= 0 || depth <= 0 || depth > 16) {
+        usage();
+        return 1;
+    }
+
+    load_request_len = snprintf(load_request, sizeof(load_request),
+                                "GET %s HTTP/1.1\r\nHost: %s:%d\r\nConnection: keep-alive\r\n%s\r\n",
+                                argv[optind], ipaddr, port, browser ? load_browser_headers : "");
+    if (load_request_len >= sizeof(load_request)) {
+        fprintf(stderr, "uri too long\n");
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, ipaddr, &addr.sin_addr);
+
+    epfd = epoll_create1(0);
+    conns = (load_conn_t *)calloc(nconn, sizeof(load_conn_t));
+    if (epfd < 0 || conns == NULL) {
+        perror("http_load");
+        return 1;
+    }
+
+    if (pid) {
+        cpu_start = load_cpu(pid);
+    }
+    start = load_now();
+
+    for (int i = 0; i < nconn; i++) {
+        conns[i].fd = load_connect(&addr);
+        if (conns[i].fd < 0) {
+            perror("connect");
+            return 1;
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &conns[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+
+        if (load_send(&conns[i], depth) < 0) {
+            perror("send");
+            return 1;
+        }
+    }
+
+    while (load_done < load_total) {
+        n = epoll_wait(epfd, events, 256, 10000);
+        if (n <= 0) {
+            fprintf(stderr, "no response for 10 s, %ld of %ld done\n", load_done, load_total);
+            return 1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            load_conn_t *c = (load_conn_t *)events[i].data.ptr;
+
+            if (load_recv(c) < 0 || load_send(c, depth) < 0) {
+                fprintf(stderr, "connection lost, %ld of %ld done\n", load_done, load_total);
+                return 1;
+            }
+        }
+    }
+
+    elapsed = load_now() - start;
+
+    printf("%ld requests in %.3f s, %ld not 200\n", load_done, elapsed, load_errors);
+    printf("%.0f req/s, %.1f MB/s\n", load_done / elapsed, load_bytes / elapsed / 1e6);
+
+    if (cpu_start >= 0 && (cpu_end = load_cpu(pid)) >= 0) {
+        printf("server cpu %.2f us/req\n",
+               (cpu_end - cpu_start) * 1e6 / sysconf(_SC_CLK_TCK) / load_done);
+    }
+
+    for (int i = 0; i < nconn; i++) {
+        close(conns[i].fd);
+    }
+    free(conns);
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http.h"
+#include "http_parse.h"
+#include "http_request.h"
+#include "ring_log.h"
+#include "util.h"
+
+/*
+*   http_parse_request over a fixed corpus of requests, copied one after
+*   the other into the ring of a connection the way handle_read leaves
+*   them, so the requests wrap the ring like on a busy keep-alive
+*   connection. Every request is parsed and its headers are stored.
+*
+*   "make bench" builds the parser three times: parse_bench with the
+*   default http_scan (SSE2 on x86-64), parse_bench_scalar with
+*   HTTP_NO_SIMD and parse_bench_avx2 with -mavx2.
+*
+*   ./bin/parse_bench -n 1000000
+*/
+
+conf_t cf;
+char conf_buf[BUFLEN];
+
+static const char *parse_bench_corpus[] = {
+    /* a browser navigation */
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8866\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Referer: http://localhost:8866/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,zh-CN;q=0.8,zh;q=0.7\r\n"
+    "Cookie: session=8f2d4c1a9b7e6f3d2c1b0a9f8e7d6c5b; theme=dark; "
+    "lang=en; _ga=GA1.1.1234567890.1700000000\r\n"
+    "\r\n",
+
+    /* a revalidation of a script */
+    "GET /static/js/app.3f9c2b1d.js?v=20240101 HTTP/1.1\r\n"
+    "Host: localhost:8866\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:121.0) Gecko/20100101 Firefox/121.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Encoding: gzip\r\n"
+    "If-None-Match: \"11e098-25a-5e298032\"\r\n"
+    "If-Modified-Since: Thu, 23 Jan 2020 11:14:58 GMT\r\n"
+    "\r\n",
+
+    /* a tool */
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost:8866\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+
+    NULL
+};
+
+static double parse_bench_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    http_request_t request;
+    size_t len[16], bytes = 0;
+    long n = 1000000;
+    int ncorpus, opt, ret;
+    double start, elapsed;
+
+    while ((opt = getopt(argc, argv, "n:h")) != -1) {
+        switch (opt) {
+            case 'n': n = atol(optarg); break;
+            default:
+                fprintf(stderr, "parse_bench [-n requests]\n");
+                return 1;
+        }
+    }
+
+    LOG_INIT("./log", "parse_bench", ERROR);
+
+    for (ncorpus = 0; parse_bench_corpus[ncorpus] != NULL; ncorpus++) {
+        len[ncorpus] = strlen(parse_bench_corpus[ncorpus]);
+    }
+
+    init_request_t(&request, -1, -1, &cf);
+    request.buf = http_ring_alloc();
+    if (request.buf == NULL) {
+        perror("parse_bench");
+        return 1;
+    }
+
+    start = parse_bench_now();
+
+    for (long i = 0; i < n; i++) {
+        int k = i % ncorpus;
+
+        memcpy(http_ring_at(&request, request.last), parse_bench_corpus[k], len[k]);
+        request.last += len[k];
+        bytes += len[k];
+
+        ret = http_parse_request(&request);
+        if (ret != RETURN_OK || request.method != HTTP_GET) {
+            fprintf(stderr, "request %d does not parse: %d\n", k, ret);
+            return 1;
+        }
+
+        reset_request_t(&request);
+    }
+
+    elapsed = parse_bench_now() - start;
+
+    printf("%ld requests, %.0f ns/req, %.2f GB/s\n",
+           n, elapsed * 1e9 / n, bytes / elapsed / 1e9);
+
+    return 0;
+}
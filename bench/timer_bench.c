@@ -0,0 +1,148 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http_request.h"
+#include "timer.h"
+#include "clock.h"
+#include "epoll.h"
+#include "ring_log.h"
+#include "util.h"
+
+/*
+*   connection timers under keep-alive load, rbtree against wheel. n idle
+*   connections have timers spread over TIMER_BENCH_TIMEOUT. Every op is
+*   the turnaround of a request: event_del_timer, then event_add_timer at
+*   now + TIMER_BENCH_TIMEOUT, on the connections in turn. The cached clock
+*   moves 1 ms every TIMER_BENCH_OPS_PER_MS ops, when the loop looks for the
+*   next timer and expires due ones like the event loop does.
+*
+*   ./bin/timer_bench -n 1000000 -o 2000000
+*/
+
+#define TIMER_BENCH_TIMEOUT         60000   /* ms */
+#define TIMER_BENCH_OPS_PER_MS      100
+
+conf_t cf;
+char conf_buf[BUFLEN];
+
+static double timer_bench_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ns per turnaround, -1 if a timer expired: nothing may time out while it is re-armed */
+static double timer_bench_run(int type, long n, long ops) {
+    timer_shard_t shard;
+    http_request_t *requests, *r;
+    double start, elapsed;
+    int epfd;
+
+    requests = (http_request_t *)calloc(n, sizeof(http_request_t));
+    epfd = Epoll_Create(0);
+    if (requests == NULL || epfd < 0) {
+        perror("timer_bench");
+        exit(1);
+    }
+
+    event_timer_init(type);
+    if (event_timer_shard_init(&shard, epfd) < 0) {
+        perror("timer_bench");
+        exit(1);
+    }
+    timer_shard_self = &shard;
+
+    for (long i = 0; i < n; i++) {
+        r = &requests[i];
+        r->fd = -1;
+        r->epfd = epfd;
+        r->timer_shard = &shard;
+        event_add_timer(r, TIMER_BENCH_TIMEOUT * (i + 1) / n);
+    }
+
+    start = timer_bench_now();
+
+    for (long k = 0; k < ops; k++) {
+        r = &requests[k % n];
+        event_del_timer(r);
+        event_add_timer(r, TIMER_BENCH_TIMEOUT);
+
+        if (k % TIMER_BENCH_OPS_PER_MS == TIMER_BENCH_OPS_PER_MS - 1) {
+            clock_cached_msec++;
+            event_find_timer();
+            event_expire_timers();
+        }
+    }
+
+    elapsed = timer_bench_now() - start;
+
+    for (long i = 0; i < n; i++) {
+        if (!requests[i].timerset) {
+            elapsed = -1;
+            break;
+        }
+    }
+
+    close(shard.wakefd);
+    close(epfd);
+    free(requests);
+
+    return elapsed < 0 ? -1 : elapsed * 1e9 / ops;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "timer_bench [option]...\n"
+        "  -t <timer>  rbtree or wheel, default both\n"
+        "  -n <num>    idle connections, default 1000000\n"
+        "  -o <num>    turnarounds, default 2000000\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *timer = NULL;
+    long n = 1000000, ops = 2000000;
+    double ns;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:n:o:h")) != -1) {
+        switch (opt) {
+            case 't': timer = optarg; break;
+            case 'n': n = atol(optarg); break;
+            case 'o': ops = atol(optarg); break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    /* a connection is re-armed every n ops, before its timer is due */
+    if (n <= 0 || ops <= 0 || n / TIMER_BENCH_OPS_PER_MS >= TIMER_BENCH_TIMEOUT) {
+        usage();
+        return 1;
+    }
+
+    LOG_INIT("./log", "timer_bench", ERROR);
+    clock_init();
+
+    for (int type = EVENT_TIMER_RBTREE; type <= EVENT_TIMER_WHEEL; type++) {
+        const char *name = type == EVENT_TIMER_WHEEL ? "wheel" : "rbtree";
+
+        if (timer && strcmp(timer, name) != 0) {
+            continue;
+        }
+
+        ns = timer_bench_run(type, n, ops);
+        if (ns < 0) {
+            printf("%-8s %ld idle: a timer expired\n", name, n);
+            return 1;
+        }
+
+        printf("%-8s %ld idle: %.0f ns per turnaround\n", name, n, ns);
+    }
+
+    return 0;
+}
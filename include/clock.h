@@ -0,0 +1,52 @@
+#ifndef __CLOCK_H
+#define __CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+*   process wide cached clock. Every event loop calls clock_update once per
+*   iteration, everything else (timers, log, response headers) reads the
+*   cached values instead of calling gettimeofday/strftime.
+*
+*   A new slot is filled when the second changes and then published, so a
+*   reader keeps a consistent clock_time_t for CLOCK_SLOTS seconds.
+*/
+#define CLOCK_SLOTS             64
+#define CLOCK_HTTP_DATE_LEN     (sizeof("Mon, 28 Sep 1970 06:00:00 GMT") - 1)
+#define CLOCK_LOG_DATE_LEN      (sizeof("1970-09-28 06:00:00") - 1)
+
+typedef struct clock_time_s {
+    time_t  sec;
+    /* local time, for the log */
+    int     year;
+    int     mon;
+    int     day;
+    int     hour;
+    int     min;
+    int     tm_sec;
+
+    char    http_date[CLOCK_HTTP_DATE_LEN + 1];
+    char    log_date[CLOCK_LOG_DATE_LEN + 1];
+} clock_time_t;
+
+extern uint64_t         clock_cached_msec;
+extern clock_time_t    *clock_cached_time;
+
+void clock_init(void);
+void clock_update(void);
+/* format t as an HTTP-date, buf holds at least CLOCK_HTTP_DATE_LEN + 1 bytes */
+void clock_http_date(time_t t, char *buf);
+/* the time of an IMF-fixdate like clock_http_date writes, -1 if it is not one */
+time_t clock_parse_http_date(const char *p, size_t len);
+
+/* ms since the epoch */
+static inline uint64_t clock_msec(void) {
+    return __atomic_load_n(&clock_cached_msec, __ATOMIC_ACQUIRE);
+}
+
+static inline clock_time_t *clock_time(void) {
+    return __atomic_load_n(&clock_cached_time, __ATOMIC_ACQUIRE);
+}
+
+#endif
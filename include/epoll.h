@@ -7,10 +7,28 @@
 
 extern int epfd;
 
+/*
+*   event backend, chosen by "backend" in httpserver.conf. Every backend
+*   reports readiness with epoll semantics, so the handlers do not care
+*   which one is in use.
+*/
+typedef struct event_backend_s {
+    const char *name;
+    int (*create)(int flags);
+    int (*ctl)(int epfd, int op, int fd, struct epoll_event *event);
+    int (*wait)(int epfd, struct epoll_event *events, int maxevents, int timeout);
+} event_backend_t;
+
+extern event_backend_t epoll_backend;
+extern event_backend_t uring_backend;
+
+int event_backend_select(const char *name);
+event_backend_t *event_backend_selected(void);
+
 int Epoll_Create(int flags);
 void Epoll_Add(int epfd, int fd, struct epoll_event *event);
 void Epoll_Mod(int epfd, int fd, struct epoll_event *event);
 void Epoll_Del(int epfd, int fd, struct epoll_event *event);
 int Epoll_Wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,101 @@
+#ifndef __FILE_CACHE_H
+#define __FILE_CACHE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "list.h"
+#include "clock.h"
+
+/*
+*   open file cache, like nginx's open_file_cache. A hit gives the open fd,
+*   size, mtime, MIME type and ETag of a path without stat or open, and
+*   the status line and entity headers of a 200, serialized once.
+*
+*   The table is split in shards, each with its own lock, hash chains and
+*   LRU list. Entries are reference counted: the table holds one reference
+*   and every response that sends the file holds another, so an evicted or
+*   replaced entry is closed only when its last response is sent. An entry
+*   is checked against the file system with stat once it is older than
+*   "openfilevalid" seconds. Failed lookups are cached too.
+*
+*   Small files are hot objects: the whole body is read into an immutable
+*   block, shared by every response that sends it,
+*   up to "hotcache" bytes in total. An inotify thread watching the root
+*   tree drops the entry of a file as soon as it is written, moved or
+*   deleted.
+*/
+#define FILE_CACHE_SHARDS           16
+#define FILE_CACHE_MAX_DEFAULT      1024    /* "openfiles" in httpserver.conf */
+#define FILE_CACHE_VALID_DEFAULT    60      /* s, "openfilevalid" */
+#define FILE_CACHE_REPORT           60      /* s between hit ratio log lines */
+#define FILE_CACHE_ETAG_LEN         (2 + 3 * 16 + 4)    /* W/"ino-size-mtime" */
+#define FILE_CACHE_HOT_DEFAULT      (16 * 1024 * 1024)  /* bytes, "hotcache" */
+#define FILE_CACHE_HOT_FILE_DEFAULT (64 * 1024)         /* bytes, "hotfilemax" */
+#define FILE_CACHE_HEADER_LEN       384     /* status line and entity headers */
+
+/*
+*   another encoding of a cached file, built once and kept by the entry:
+*   either a sibling file (e.g. the .gz next to it) or a block of memory
+*/
+typedef struct file_cache_variant_s {
+    struct file_cache_entry_s *file;   /* sent from this entry, or NULL */
+    char           *data;           /* or from memory */
+    size_t          size;
+    char            etag[FILE_CACHE_ETAG_LEN + 4];
+    size_t          header_len;     /* 0: no variant, send the file as it is */
+    char            header[FILE_CACHE_HEADER_LEN];
+} file_cache_variant_t;
+
+typedef struct file_cache_entry_s {
+    list_head       lru;
+    struct file_cache_entry_s *hash_next;
+    uint32_t        hash;
+    int             refs;
+    int             cached;         /* in the table */
+
+    int             fd;             /* -1 if it is not a regular file */
+    int             err;            /* errno of stat/open, 0 on success */
+    mode_t          mode;
+    off_t           size;
+    time_t          mtime;
+    long            mtime_nsec;
+    ino_t           ino;
+    const char     *mime;
+    char            etag[FILE_CACHE_ETAG_LEN + 1];
+    char            last_modified[CLOCK_HTTP_DATE_LEN + 1];
+    int             vary;           /* the response depends on Accept-Encoding */
+    uint64_t        valid_until;    /* ms, revalidate after */
+    char           *data;           /* hot object: the body */
+    size_t          header_len;
+    char            header[FILE_CACHE_HEADER_LEN];
+    file_cache_variant_t *gzip;     /* set once, on the first request taking gzip */
+
+    size_t          len;
+    char            name[];
+} file_cache_entry_t;
+
+typedef struct file_cache_stat_s {
+    uint64_t        hits;
+    uint64_t        misses;
+    uint64_t        entries;
+    uint64_t        hot_bytes;
+} file_cache_stat_t;
+
+/*
+*   max entries, 0 opens every file and closes it after the response. Files
+*   up to hot_file bytes are kept in memory while hot bytes are left, root
+*   is watched for changes
+*/
+int file_cache_init(int max, int valid, const char *root, size_t hot, size_t hot_file);
+/* entry for path with a reference, err is set when the file can not be used */
+file_cache_entry_t *file_cache_get(const char *path);
+/* one more reference, for another link sending from the entry */
+void file_cache_ref(file_cache_entry_t *fe);
+void file_cache_release(file_cache_entry_t *fe);
+/* drop the entry of path, the next lookup opens the file again */
+void file_cache_invalidate(const char *path);
+void file_cache_stat(file_cache_stat_t *st);
+
+#endif
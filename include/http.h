@@ -7,19 +7,24 @@
 #define MAXLINE 8192
 #define SHORTLINE 512
 
+/* m is read as a little endian word */
 #define str3cmp(m, c0, c1, c2, c3)          \
-        *(uint32_t *)m == ((c0 << 24) | (c1 << 16) | (c2 << 8) | c3)
+        *(uint32_t *)m == ((c3 << 24) | (c2 << 16) | (c1 << 8) | c0)
 
-typedef struct mime_type_s {
-    const char *type;
-    const char *value;
-}mime_type_t;
+struct http_request_s;
 
 // 处理连接的回调函数
 void handle_conn(void *ptr);
-// 处理读事件的回调函数
+// request of a socket accepted on listen_request, NULL with the socket closed on errors
+struct http_request_s *http_init_conn(struct http_request_s *listen_request, int sockfd);
+// 处理读事件的回调函数, 调用前事件循环已将连接的定时器标记为busy
 void handle_read(void *ptr);
-// 处理写事件的回调函数
+// 处理写事件的回调函数, 同上
 void handle_write(void *ptr);
+// status line and entity headers of a 200 for the file or its variant v, returns the length like snprintf
+struct file_cache_entry_s;
+struct file_cache_variant_s;
+size_t http_entity_header(struct file_cache_entry_s *fe, struct file_cache_variant_s *v,
+                          char *buf, size_t len);
 
 #endif
\ No newline at end of file
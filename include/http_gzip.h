@@ -0,0 +1,28 @@
+#ifndef __HTTP_GZIP_H
+#define __HTTP_GZIP_H
+
+#include <stddef.h>
+#include "file_cache.h"
+
+/*
+*   gzip content negotiation. A client sending "Accept-Encoding: gzip"
+*   gets the gzip variant of the file: the .gz file next to it when it is
+*   at least as new ("gzipstatic"), or else, with "gzip=on", the file
+*   compressed once in memory. Variants live in the entry of the file in
+*   the open file cache, so they are keyed by path and mtime and go away
+*   with the entry; with "openfiles=off" nothing is compressed in memory.
+*   Compressed bytes are limited by "gzipcache".
+*/
+#define HTTP_GZIP_MIN_LENGTH        256             /* smaller files gain nothing */
+#define HTTP_GZIP_MAX_LENGTH        (1024 * 1024)   /* larger ones are compressed ahead, as .gz */
+#define HTTP_GZIP_LEVEL             6
+#define HTTP_GZIP_CACHE_DEFAULT     (16 * 1024 * 1024)  /* bytes, "gzipcache" */
+
+int http_gzip_init(int on, int use_static, size_t cache);
+/* 1 if responses for the file depend on Accept-Encoding */
+int http_gzip_vary(file_cache_entry_t *fe);
+/* the gzip variant of fe, NULL to send the file as it is */
+file_cache_variant_t *http_gzip_variant(file_cache_entry_t *fe);
+void http_gzip_free(file_cache_variant_t *v);
+
+#endif
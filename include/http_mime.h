@@ -0,0 +1,27 @@
+#ifndef __HTTP_MIME_H
+#define __HTTP_MIME_H
+
+#include <stdint.h>
+
+/*
+*   MIME types by file extension. The built-in types and those of a
+*   mime.types file ("mimetypes" in httpserver.conf, Apache or nginx
+*   format, its types win) are hashed into an open addressing table once
+*   at startup. It is never written again, so workers read it without a
+*   lock. Extensions are matched case-insensitively; the open file cache
+*   keeps the type of every entry, so a lookup runs once per open.
+*/
+#define HTTP_MIME_EXTEN_LEN     16              /* longer extensions get the default */
+#define HTTP_MIME_DEFAULT       "text/plain"
+
+typedef struct mime_type_s {
+    const char *type;       /* extension, without the dot */
+    const char *value;
+}mime_type_t;
+
+/* file is a mime.types file, or NULL for the built-in types only */
+int http_mime_init(const char *file);
+// MIME type of the extension of the last component of path
+const char* get_file_type(const char *path);
+
+#endif
@@ -7,7 +7,12 @@
 #define LF '\n'
 #define CRLFCRLF "\r\n\r\n"
 
+/* http_parse_range: none of the ranges overlaps the file */
+#define HTTP_PARSE_RANGE_NOT_SATISFIABLE    -1
+
 int http_parse_request_line(http_request_t *r);
 int http_parse_request_body(http_request_t *r);
+int http_parse_request(http_request_t *r);
+int http_parse_range(const char *p, size_t len, off_t size, http_range_t *ranges, int max);
 
 #endif
\ No newline at end of file
@@ -3,18 +3,29 @@
 
 #include <errno.h>
 #include <time.h>
-#include <math.h>
+#include <sys/uio.h>
 
 #include "http.h"
 #include "list.h"
 #include "util.h"
 #include "rbtree.h"
+#include "timer_wheel.h"
+#include "file_cache.h"
+#include "uring.h"
 
 #define AGAIN    EAGAIN
 
 #define HTTP_PARSE_INVALID_METHOD        10
 #define HTTP_PARSE_INVALID_REQUEST       11
 #define HTTP_PARSE_INVALID_HEADER        12
+#define HTTP_PARSE_INVALID_BODY          13
+#define HTTP_PARSE_BODY_TOO_LARGE        14
+
+/* request->parse_phase, a request is parsed across several reads */
+#define HTTP_PARSE_LINE                  0
+#define HTTP_PARSE_HEADERS               1
+#define HTTP_PARSE_BODY                  2
+#define HTTP_PARSE_DONE                  3
 
 #define HTTP_UNKNOWN                     0x0001
 #define HTTP_GET                         0x0002
@@ -22,22 +33,162 @@
 #define HTTP_POST                        0x0008
 
 #define HTTP_OK                          200
+#define HTTP_PARTIAL_CONTENT             206
 
 #define HTTP_NOT_MODIFIED                304
 
 #define HTTP_NOT_FOUND                   404
 
-#define MAX_BUF 8124
+#define HTTP_REQUEST_ENTITY_TOO_LARGE    413
+#define HTTP_RANGE_NOT_SATISFIABLE       416
+
+/* limit of a request body, "maxbody" in httpserver.conf */
+#define HTTP_MAX_BODY_DEFAULT            (1024 * 1024)
+
+/*
+*   read buffer of a connection, a ring of MAX_BUF bytes mapped twice back
+*   to back: buf[i] and buf[i + MAX_BUF] are the same byte, so a request
+*   never straddles the wrap. A multiple of the page size
+*/
+#define MAX_BUF 8192
+#define HTTP_RING_CACHE                  256    /* free rings kept mapped */
+
+/*
+*   connection state. The fd is registered once in handle_conn and then
+*   switched between reading and writing with EPOLL_CTL_MOD | EPOLLONESHOT,
+*   or on the ring of a reactor a recv or the sends of the chain are
+*   submitted in place of the wait (http_uring.c)
+*/
+#define HTTP_CONN_READ                   0
+#define HTTP_CONN_WRITE                  1
 
 #define RETURN_OK       0
 #define RETURN_ERROR    -1
 
+/*
+*   responses to pipelined requests are queued in a chain: headers are
+*   copied to buf and a run of them goes out with one sendmsg, file bodies
+*   are sent from the page cache with sendfile, or splice when the file
+*   system can not sendfile. The chain lives in the request until it is
+*   sent, a full socket resumes it on EPOLLOUT. Hot objects are sent from
+*   the shared block of their cache entry, the link holds a reference
+*/
+#define HTTP_CHAIN_IOV                   64
+#define HTTP_CHAIN_BUF                   8192
+#define HTTP_CHAIN_RESERVE               4096   /* room for the headers of one more response */
+#define HTTP_SENDFILE_CHUNK              (512 * 1024)
+
+/*
+*   on the ring a flush is one run of linked requests: a sendmsg per run of
+*   memory links, and per chunk of a file a splice to the pipe and one from
+*   it. A short one cancels the rest, the next run starts where it stopped
+*/
+#define HTTP_CHAIN_OPS                   16
+
+#define HTTP_CHAIN_OP_SEND               0
+#define HTTP_CHAIN_OP_FILE               1      /* file -> pipe */
+#define HTTP_CHAIN_OP_PIPE               2      /* pipe -> socket */
+
+typedef struct http_chain_op_s {
+    uring_io_t io;              /* first, the completion finds the op by it */
+    int type;
+    int link;
+    int end;                    /* past the memory links of a sendmsg */
+    off_t offset;               /* in the file */
+    size_t len;
+    int res;
+    struct msghdr msg;
+} http_chain_op_t;
+
+/*
+*   Range requests: at most HTTP_RANGES_MAX ranges are answered, a request
+*   with more gets the whole file. A multipart/byteranges response takes a
+*   header and a body link per range
+*/
+#define HTTP_RANGES_MAX                  8
+#define HTTP_CHAIN_RESERVE_IOV           (2 * HTTP_RANGES_MAX + 3)
+
+typedef struct http_range_s {
+    off_t start;
+    off_t end;          /* last byte, inclusive */
+} http_range_t;
+
+typedef struct http_chain_s {
+    int fd;
+    /* a file link has no iov_base, iov_len is what is left to send */
+    struct iovec iov[HTTP_CHAIN_IOV];
+    file_cache_entry_t *files[HTTP_CHAIN_IOV];  /* entry the link holds, NULL for buf */
+    off_t offsets[HTTP_CHAIN_IOV];      /* next byte of the file */
+    int niov;
+    size_t used;
+    int splice;                         /* sendfile is not supported */
+    int pipe[2];                        /* for splice, opened on first use */
+    size_t piped;                       /* file bytes waiting in the pipe */
+    size_t pipe_size;
+    http_chain_op_t ops[HTTP_CHAIN_OPS];    /* on the ring, in flight */
+    int nops;
+    char buf[HTTP_CHAIN_BUF];
+} http_chain_t;
+
+#define http_chain_is_file(c, i)  ((c)->files[i] != NULL && (c)->iov[i].iov_base == NULL)
+
+/*
+*   parsed headers live in an array inside http_request_t, a request with
+*   more than HTTP_HEADERS_INLINE headers spills to an arena which is kept
+*   until the connection is closed
+*/
+#define HTTP_HEADERS_INLINE              32
+#define HTTP_HEADERS_MAX                 1024
+
+/*
+*   known request headers are found with a perfect hash of the length, the
+*   first and the last character of the name, case-insensitive. The
+*   constants and http_header_hash_index[] are generated from the names in
+*   http_headers_in, search them again when a header is added
+*/
+#define HTTP_HEADER_HASH_SIZE            16
+#define HTTP_HEADER_HASH_A               1
+#define HTTP_HEADER_HASH_B               7
+
+#define http_header_hash(len, first, last)                              \
+        (((len) + ((first) | 0x20) * HTTP_HEADER_HASH_A                 \
+                + ((last) | 0x20) * HTTP_HEADER_HASH_B) & (HTTP_HEADER_HASH_SIZE - 1))
+
+#define http_string(str)    str, sizeof(str) - 1
+
+/* headers the parser itself needs, index in http_headers_in */
+#define HTTP_HEADER_CONTENT_LENGTH       7
+#define HTTP_HEADER_TRANSFER_ENCODING    8
+
+typedef struct http_header_s {
+    void *key_start, *key_end;          /* not include end */
+    void *value_start, *value_end;
+    int id;                             /* index in http_headers_in, -1 if unknown */
+} http_header_t;
+
+struct timer_shard_s;
+struct http_request_s;
+
+/* completion io of a connection on the ring of its reactor, see http_uring.c */
+typedef struct http_uring_s {
+    int on;
+    uring_io_t io;          /* the recv, the accept of a listening socket */
+    int res;                /* of the recv, -EAGAIN once handle_read took it */
+    int inflight;           /* requests on the ring */
+    int closing;            /* closed while they run, the last completion closes */
+} http_uring_t;
+
+/* receives the request body piece by piece, non RETURN_OK aborts the request */
+typedef int (*http_body_handler_pt)(struct http_request_s *r, const char *data, size_t len);
+
 typedef struct http_request_s {
     void *root;
     int fd;
     int epfd;
-    char buf[MAX_BUF];  /* ring buffer */
+    char *buf;          /* ring buffer, see MAX_BUF */
     size_t pos, last;
+    size_t begin;       /* first byte of the request being parsed or answered */
+    int parse_phase;
     int state;
     void *request_start;
     void *method_end;   /* not include method_end*/
@@ -52,50 +203,115 @@ typedef struct http_request_s {
     int http_minor;
     void *request_end;
 
-    struct list_head list;  /* store http header */
+    http_header_t headers[HTTP_HEADERS_INLINE];     /* store http header */
+    http_header_t *spill;
+    int nheaders;
+    int spill_size;
     void *cur_header_key_start;
     void *cur_header_key_end;
+    int cur_header_id;
     void *cur_header_value_start;
     void *cur_header_value_end;
 
+    /*
+    *   the body is streamed, not buffered: consumed bytes are dead, so the
+    *   ring goes back to body_start once the parser has handed them over
+    */
+    size_t max_body;
+    size_t body_start;
+    size_t body_rest;       /* left in the body, or in the current chunk */
+    size_t body_received;
+    int chunked;
+    int body_state;
+    http_body_handler_pt body_handler;
+    int err_status;         /* answer with this error instead of the file */
+
+    http_chain_t *chain;    /* responses not sent yet */
+    int keep_alive;         /* cleared by a response that closes the connection */
+
     rbtree_node_t timer;
+    timer_wheel_node_t wheel;
     int timerset;
+    struct timer_shard_s *timer_shard;      /* owned by the event loop of the connection */
+    struct http_request_s *timer_next;      /* posted to timer_shard by another thread */
+    int timer_op;
+    uint64_t timer_deadline;    /* real expire time, the timer key may lag behind it */
+    int timer_busy;             /* a handler is running, do not expire */
+
+    int conn_state;     /* HTTP_CONN_READ or HTTP_CONN_WRITE */
+    http_uring_t uring;
 
 } http_request_t;
 
 typedef struct {
     int fd;
     int keep_alive;
-    time_t mtime;       /* the modified time of the file*/
-    int modified;       /* compare If-modified-since field with mtime to decide whether the file is modified since last time*/
+    int header_only;    /* HEAD: the headers of a GET, no body */
+    /* conditional headers, checked by serve_static against the cached file */
+    char *if_modified_since;
+    int if_modified_since_len;
+    char *if_none_match;
+    int if_none_match_len;
+    int gzip;           /* Accept-Encoding takes gzip */
+    char *range;        /* value of Range, parsed once the size of the file is known */
+    int range_len;
+    char *if_range;     /* value of If-Range */
+    int if_range_len;
 
     int status;
+    http_chain_t *chain;
 } http_out_t;
 
-typedef struct http_header_s {
-    void *key_start, *key_end;          /* not include end */
-    void *value_start, *value_end;
-    list_head list;
-} http_header_t;
-
 typedef int (*http_header_handler_pt)(http_request_t *r, http_out_t *o, char *data, int len);
 
 typedef struct {
     char *name;
+    int len;
     http_header_handler_pt handler;
 } http_header_handle_t;
 
+static inline http_header_t *http_header_at(http_request_t *r, int i) {
+    return i < HTTP_HEADERS_INLINE ? &r->headers[i] : &r->spill[i - HTTP_HEADERS_INLINE];
+}
+
+/*
+*   address of byte i of the ring. Counted from the start of the current
+*   request, so everything from begin up to begin + MAX_BUF is contiguous
+*/
+static inline char *http_ring_at(http_request_t *r, size_t i) {
+    return r->buf + r->begin % MAX_BUF + (i - r->begin);
+}
+
+char *http_ring_alloc(void);
+void http_ring_free(char *buf);
+
+http_header_t *http_add_header(http_request_t *r);
+int http_header_lookup(const char *name, int len);
 void http_handle_header(http_request_t *r, http_out_t *o);
 int http_close_conn(http_request_t *r);
 
 int init_request_t(http_request_t *r, int fd, int epfd, conf_t *cf);
+int reset_request_t(http_request_t *r);
 int free_request_t(http_request_t *r);
 
 int init_out_t(http_out_t *o, int fd);
 int free_out_t(http_out_t *o);
 
+void http_chain_init(http_chain_t *c, int fd);
+int http_chain_room(http_chain_t *c);
+void http_chain_free(http_chain_t *c);
+int http_chain_copy(http_chain_t *c, const char *data, size_t len);
+int http_chain_add_file(http_chain_t *c, file_cache_entry_t *fe, off_t offset, size_t len);
+int http_chain_add_mem(http_chain_t *c, file_cache_entry_t *fe, char *data, size_t len);
+int http_chain_flush(http_chain_t *c);
+int http_chain_submit(http_chain_t *c, int epfd, uring_handler_pt handler, void *data);
+int http_chain_complete(http_chain_t *c);
+
 const char *get_shortmsg_from_status_code(int status_code);
 
+/* body handler of new requests, the default discards the body */
+extern http_body_handler_pt     http_body_handler;
+
 extern http_header_handle_t     http_headers_in[];
 
 #endif
\ No newline at end of file
@@ -0,0 +1,24 @@
+#ifndef __HTTP_URING_H
+#define __HTTP_URING_H
+
+#include <sys/types.h>
+
+#include "http_request.h"
+
+/*
+*   connections of a reactor on its io_uring ring: handle_read and
+*   handle_write run as with readiness events, only their waits change.
+*   Where handle_read waits for EPOLLIN a recv into a provided buffer is
+*   submitted, and its completion runs handle_read on the bytes; where
+*   handle_write waits for EPOLLOUT the chain goes to the ring as linked
+*   sendmsg and splice requests, and handle_write goes on once it is sent.
+*/
+
+/* multishot accept on the listening socket, -1 if the ring can not do it */
+int http_uring_listen(http_request_t *listen_request);
+/* handle_read calls it in place of read */
+ssize_t http_uring_read(http_request_t *r, char *buf, size_t len);
+int http_uring_wait_read(http_request_t *r);
+int http_uring_flush(http_request_t *r);
+
+#endif
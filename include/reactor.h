@@ -0,0 +1,34 @@
+#ifndef __REACTOR_H
+#define __REACTOR_H
+
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#include "http_request.h"
+#include "timer.h"
+#include "util.h"
+
+#define REACTOR_MAXEVENTS 4096
+
+/*
+*   multi-reactor mode: every reactor thread owns an epoll instance and a
+*   SO_REUSEPORT listening socket, so accept, read, parse and write of a
+*   connection all run on the same thread
+*/
+typedef struct reactor_s {
+    pthread_t   tid;
+    int         id;
+    int         epfd;
+    int         listenfd;
+    struct epoll_event *events;
+    http_request_t *listen_request;
+    timer_shard_t timers;
+} reactor_t;
+
+reactor_t *reactor_init(int num_reactors, conf_t *cf);
+void reactor_wait(reactor_t *reactors, int num_reactors);
+
+// 事件循环
+void *reactor_loop(void *arg);
+
+#endif
@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <time.h>
 
 enum {
     TPOOL_ERROR,
@@ -16,8 +17,13 @@ enum {
     TPOOL_DEBUG
 };
 
+/* messages up to this level are printed, build with -DTPOOL_DEBUG_LEVEL=3 to trace */
+#ifndef TPOOL_DEBUG_LEVEL
+#define TPOOL_DEBUG_LEVEL TPOOL_WARNING
+#endif
+
 #define debug(level, ...) do { \
-    if (level <= TPOOL_DEBUG) {\
+    if (level <= TPOOL_DEBUG_LEVEL) {\
         flockfile(stdout); \
         printf("###%p.%s: ", (void *)pthread_self(), __func__); \
         printf(__VA_ARGS__); \
@@ -27,9 +33,12 @@ enum {
     }\
 } while (0)
 
+/* default capacity of a worker's ring, "queuepower" in httpserver.conf */
 #define WORK_QUEUE_POWER 8
-#define WORK_QUEUE_SIZE (1 << WORK_QUEUE_POWER)
-#define WORK_QUEUE_MASK (WORK_QUEUE_SIZE - 1)
+#define WORK_QUEUE_POWER_MAX 20
+
+/* polls of an empty queue before a worker parks on its futex */
+#define TPOOL_SPIN_COUNT 1024
 
 /*
  * Just main thread can increase thread->in, we can make it safely.
@@ -38,10 +47,18 @@ enum {
  * to our thread pool...
 */
 #define thread_out_val(thread)      (__sync_val_compare_and_swap(&(thread)->out, 0, 0))
-#define thread_queue_len(thread)   ((thread)->in - thread_out_val(thread))
+/* acquire on in: a worker that sees the new in also sees the work slot */
+#define thread_in_val(thread)       (__atomic_load_n(&(thread)->in, __ATOMIC_ACQUIRE))
+#define thread_queue_len(thread)   ((uint32_t)(thread_in_val(thread) - thread_out_val(thread)))
 #define thread_queue_empty(thread) (thread_queue_len(thread) == 0)
-#define thread_queue_full(thread)  (thread_queue_len(thread) == WORK_QUEUE_SIZE)
-#define queue_offset(val)           ((val) & WORK_QUEUE_MASK)
+#define thread_queue_full(thread)  (thread_queue_len(thread) == (thread)->queue_mask + 1)
+#define queue_offset(thread, val)   ((val) & (thread)->queue_mask)
+
+/* schedule policies */
+enum {
+    TPOOL_ROUND_ROBIN,
+    TPOOL_WORK_STEALING
+};
 
 typedef struct tpool_work {
     void    (*call_back)(void *);
@@ -51,10 +68,14 @@ typedef struct tpool_work {
 typedef struct {
     pthread_t    tid;
     int          shutdown;
+    int          sleeping;  /* futex word, 1 while the worker is parked */
+    int          index;
+    struct tpool_s *tpool;
 
-    uint8_t in;        /* offset from start of work_queue where to put work next */
-    uint8_t out;   /* offset from start of work_queue where to get work next */
-    tpool_work_t work_queue[WORK_QUEUE_SIZE];
+    uint32_t in;        /* offset from start of work_queue where to put work next */
+    uint32_t out;   /* offset from start of work_queue where to get work next */
+    uint32_t queue_mask;
+    tpool_work_t *work_queue;
 
 } thread_t;
 
@@ -64,10 +85,14 @@ struct tpool_s {
     int                 num_threads;
     thread_t            *threads;
     schedule_thread_func schedule_thread;
+    int                 steal;          /* idle workers steal from busy ones */
+    int                 num_sleeping;
+    uint64_t            overflows;      /* works the caller ran, all queues were full */
+    time_t              overflow_report;    /* s of the last overflow log line */
 };
 
 // inital
-tpool_t *tpool_init(int num_worker_threads);
+tpool_t *tpool_init(int num_worker_threads, int schedule, int queue_power);
 // add
 int tpool_add_work(tpool_t *tpool, void (* call_back)(void *), void *arg);
 // destroy
@@ -4,85 +4,65 @@
 #include <sys/time.h>
 #include <pthread.h>
 #include "rbtree.h"
+#include "timer_wheel.h"
 #include "ring_log.h"
 
 #define TIMER_INFINITE -1
-#define TIMEOUT_DEFAULT 300000     /* ms */
+#define TIMEOUT_DEFAULT_SEC 300    /* s, a literal: the Keep-Alive header stringifies it */
+#define TIMEOUT_DEFAULT (TIMEOUT_DEFAULT_SEC * 1000)     /* ms */
 #define TIMER_LAZY_DELAY 500
 
-/* 所有定时器事件组成的红黑树 */
-extern rbtree_t         event_timer_rbtree;
-/* 红黑树的哨兵节点 */
-extern rbtree_node_t    event_timer_sentinel;
-/* mutex */
-extern pthread_mutex_t  event_timer_mutex;
-
-
-int event_timer_init(void);
+/* 定时器的实现, "timer" in httpserver.conf */
+#define EVENT_TIMER_RBTREE  0
+#define EVENT_TIMER_WHEEL   1
+
+/* operations posted to a shard by other threads */
+#define EVENT_TIMER_OP_ADD  1
+#define EVENT_TIMER_OP_DEL  2
+#define EVENT_TIMER_OP_FREE 3
+
+/*
+*   every event loop (a reactor, or the dispatcher in single reactor mode)
+*   owns one timer shard. Only the owner touches the rbtree or the wheel, so
+*   there is no lock. Other threads post add/del operations to a lock-free
+*   stack which the owner drains after every wait; wakefd wakes the owner
+*   when a posted timer is due before the owner planned to wake up.
+*/
+typedef struct timer_shard_s {
+    /* 所有定时器事件组成的红黑树 */
+    rbtree_t            rbtree;
+    /* 红黑树的哨兵节点 */
+    rbtree_node_t       sentinel;
+    /* 时间轮 */
+    timer_wheel_t       wheel;
+
+    http_request_t     *posted;         /* operations from other threads */
+    uint64_t            sleep_until;    /* 0 while the owner is awake */
+    int                 wakefd;         /* eventfd in the owner's epoll set */
+} timer_shard_t;
+
+extern int              event_timer_type;
+/* shard owned by the calling thread, NULL in thread pool workers */
+extern __thread timer_shard_t *timer_shard_self;
+
+
+int event_timer_init(int type);
+int event_timer_shard_init(timer_shard_t *shard, int epfd);
 uint64_t event_find_timer(void);
+void event_process_posted(void);
 void event_expire_timers(void);
 void timeout_handle(http_request_t *);
 
-
 /* 从定时器中移除事件 */
-static inline int
-event_del_timer(http_request_t *request)
-{
-    LOG_INFO("event timer del: %d: %M",
-          request->fd, request->timer.key);
-
-    pthread_mutex_lock(&event_timer_mutex);
-
-    if(!request->timerset) {
-        /*
-        *   request->timerset=0, 说明request->timer被删除
-        */
-        pthread_mutex_unlock(&event_timer_mutex);
-        return -1;
-    }
-
-    /* 从红黑树中移除指定事件的节点对象 */
-    rbtree_delete(&event_timer_rbtree, &request->timer);
-    /* 删除后，timerset要置为0 */
-    request->timerset = 0;
-
-    pthread_mutex_unlock(&event_timer_mutex);
-
-    request->timer.left = NULL;
-    request->timer.right = NULL;
-    request->timer.parent = NULL;
-
-    return 0;
-}
-
-/* 将事件添加到定时器中 */
-static inline void
-event_add_timer(http_request_t *request, uint64_t timer)
-{
-    uint64_t        key;
-    uint64_t        curr_msec;
-    struct timeval  tv;
-
-    gettimeofday(&tv, NULL);
-    curr_msec = tv.tv_sec * 1000 + tv.tv_usec / 1000;
-
-    /* 设置事件对象节点的键值 */
-    key = curr_msec + timer;
-
-    request->timer.key = key;
-
-    LOG_INFO("event timer add: %d: %M:%M",
-          request->fd, timer, request->timer.key);
-
-    pthread_mutex_lock(&event_timer_mutex);
-
-    /* 将事件对象节点插入到红黑树中 */
-    rbtree_insert(&event_timer_rbtree, &request->timer);
-    /* timerset=1, 表示request->timer在红黑树上 */
-    request->timerset = 1;
-
-    pthread_mutex_unlock(&event_timer_mutex);
-
-}
-
-#endif
\ No newline at end of file
+int event_del_timer(http_request_t *request);
+/*
+*   将事件添加到定时器中. Lazy: the timer is only moved when the deadline
+*   changes by more than TIMER_LAZY_DELAY, expiry checks the real deadline
+*/
+void event_add_timer(http_request_t *request, uint64_t timer);
+/* a handler runs on the request, keep the timer but do not expire it */
+void event_busy_timer(http_request_t *request);
+/* remove the timer and free the request */
+void event_free_timer(http_request_t *request);
+
+#endif
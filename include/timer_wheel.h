@@ -0,0 +1,43 @@
+#ifndef __TIMER_WHEEL_H
+#define __TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "list.h"
+
+/*
+*   hierarchical timing wheel, one tick is one millisecond.
+*   tv1 holds the timers of the next 256 ticks, every tvn level covers 64
+*   times the range of the level below. Timers of an upper level are
+*   cascaded down each time tv1 wraps, so add, del and expire are O(1).
+*/
+#define TVR_BITS        8
+#define TVN_BITS        6
+#define TVR_SIZE        (1 << TVR_BITS)
+#define TVN_SIZE        (1 << TVN_BITS)
+#define TVR_MASK        (TVR_SIZE - 1)
+#define TVN_MASK        (TVN_SIZE - 1)
+#define TVN_LEVELS      4
+#define TIMER_WHEEL_MAX_TICKS   ((1ULL << (TVR_BITS + TVN_LEVELS * TVN_BITS)) - 1)
+
+typedef struct timer_wheel_node_s {
+    uint64_t    key;        /* expire time in ms */
+    list_head   list;
+} timer_wheel_node_t;
+
+typedef struct timer_wheel_s {
+    uint64_t    curr;       /* next tick to be processed */
+    size_t      count;
+    list_head   tv1[TVR_SIZE];
+    list_head   tvn[TVN_LEVELS][TVN_SIZE];
+} timer_wheel_t;
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t curr_msec);
+void timer_wheel_add(timer_wheel_t *wheel, timer_wheel_node_t *node);
+void timer_wheel_del(timer_wheel_t *wheel, timer_wheel_node_t *node);
+/* ms until the wheel has to be advanced again, (uint64_t)-1 if it is empty */
+uint64_t timer_wheel_next(timer_wheel_t *wheel, uint64_t curr_msec);
+/* move the timers expired at curr_msec to the expired list */
+void timer_wheel_expire(timer_wheel_t *wheel, uint64_t curr_msec, list_head *expired);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef __URING_H
+#define __URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+*   completion io on a ring of the io_uring backend, for the reactors: the
+*   thread that waits on the ring runs the handlers, so it is the only one
+*   that submits. A multishot accept hands out connections, recv picks a
+*   buffer from the ones provided to the ring, and responses go out as
+*   sendmsg and splice requests linked in order.
+*
+*   A completion comes out of Epoll_Wait as an event with
+*   URING_EPOLL_COMPLETION in events; uring_complete runs the handler of
+*   its request, then gives the recv buffer back to the ring.
+*/
+
+#define URING_EPOLL_COMPLETION  (1u << 27)     /* not an epoll event bit */
+#define URING_BUF_SIZE          4096
+#define URING_BUF_COUNT         1024            /* per ring, a power of 2 */
+
+typedef struct uring_io_s uring_io_t;
+typedef void (*uring_handler_pt)(uring_io_t *io, int res, uint32_t flags);
+
+/* a request on the ring, it must stay allocated until its last completion */
+struct uring_io_s {
+    uring_handler_pt    handler;
+    void               *data;
+    char               *buf;        /* the provided buffer of a recv, while the handler runs */
+};
+
+/* register the recv buffers, -1 if the kernel lacks buffer rings or multishot accept (5.19) */
+int uring_io_init(int epfd);
+/* room for n requests in the submission queue, so a linked run is submitted in one piece */
+int uring_reserve(int epfd, int n);
+int uring_accept(int epfd, int fd, uring_io_t *io);
+int uring_recv(int epfd, int fd, size_t len, uring_io_t *io);
+int uring_sendmsg(int epfd, int fd, struct msghdr *msg, int flags, int link, uring_io_t *io);
+/* off_in -1: from the current position of a pipe */
+int uring_splice(int epfd, int fd_in, int64_t off_in, int fd_out, size_t len,
+                 unsigned flags, int link, uring_io_t *io);
+void uring_complete(void *done);
+
+#endif
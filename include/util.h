@@ -23,11 +23,25 @@ struct conf_s {
     int port;
     int thread_num;
     int loglevel;
+    int multi_reactor;  /* one epoll loop and SO_REUSEPORT listener per thread */
+    void *backend;      /* event backend: epoll or io_uring, where a reactor also does its io on the ring */
+    void *schedule;     /* thread pool policy: roundrobin or workstealing */
+    int queue_power;    /* capacity of every worker's queue is 2^queue_power */
+    void *timer;        /* connection timers: rbtree or wheel */
+    long max_body;      /* largest request body in bytes */
+    void *open_files;   /* entries of the open file cache, or off */
+    int open_file_valid;    /* s before a cached file is checked again */
+    void *hot_cache;    /* bytes of small files kept in memory, or off */
+    long hot_file_max;  /* largest file kept in memory */
+    void *gzip;         /* on: compress text in memory for clients taking gzip */
+    void *gzip_static;  /* off: do not send the .gz next to a file */
+    long gzip_cache;    /* bytes of compressed files kept in memory */
+    void *mime_types;   /* mime.types file read at startup, on top of the built-in types */
 };
 
 typedef struct conf_s conf_t;
 
-int open_listenfd(int port);
+int open_listenfd(int port, int reuseport);
 int set_socket_non_blocking(int fd);
 
 int read_conf(char *filename, conf_t *cf, char *buf, int len);
@@ -10,9 +10,13 @@
 #include "http.h"
 #include "http_request.h"
 #include "http_parse.h"
+#include "http_gzip.h"
+#include "http_mime.h"
 #include "epoll.h"
 #include "timer.h"
+#include "clock.h"
 #include "threadpool.h"
+#include "reactor.h"
 #include "util.h"
 
 #define CONF                "httpserver.conf"
@@ -32,6 +36,17 @@ static const struct option long_options[]=
     {NULL,0,NULL,0}
 };
 
+/*
+*   hand the event to the thread pool. When every worker queue is full the
+*   dispatcher runs it itself: the event is not lost, and the dispatcher
+*   stops accepting and reading until the workers catch up
+*/
+static void dispatch(tpool_t *tpool, void (*call_back)(void *), void *arg) {
+    if(tpool_add_work(tpool, call_back, arg) < 0) {
+        call_back(arg);
+    }
+}
+
 static void usage() {
    fprintf(stderr,
 	"httpserver [option]... \n"
@@ -95,10 +110,77 @@ int main(int argc, char* argv[]) {
     */
     signal(SIGPIPE, SIG_IGN);
 
+    // everything below reads the cached clock
+    clock_init();
+
+    if(event_backend_select(cf.backend) < 0) {
+        printf("unknown event backend: %s\n", (char *)cf.backend);
+        return 0;
+    }
+
+    int timer_type = EVENT_TIMER_RBTREE;
+    if(cf.timer && strcmp(cf.timer, "wheel") == 0) {
+        timer_type = EVENT_TIMER_WHEEL;
+    }
+
+    int open_files = FILE_CACHE_MAX_DEFAULT;
+    if(cf.open_files) {
+        open_files = strcmp(cf.open_files, "off") == 0 ? 0 : atoi(cf.open_files);
+    }
+
+    size_t hot_cache = FILE_CACHE_HOT_DEFAULT;
+    if(cf.hot_cache) {
+        hot_cache = strcmp(cf.hot_cache, "off") == 0 ? 0 : (size_t)atol(cf.hot_cache);
+    }
+    size_t hot_file_max = cf.hot_file_max > 0 ? (size_t)cf.hot_file_max : FILE_CACHE_HOT_FILE_DEFAULT;
+
+    int gzip = cf.gzip && strcmp(cf.gzip, "on") == 0;
+    int gzip_static = !(cf.gzip_static && strcmp(cf.gzip_static, "off") == 0);
+    size_t gzip_cache = cf.gzip_cache > 0 ? (size_t)cf.gzip_cache : HTTP_GZIP_CACHE_DEFAULT;
+
+    /* the compressed copy is kept by the open file cache entry, without the cache it would be redone per request */
+    if(gzip && open_files == 0) {
+        printf("gzip=on needs the open file cache, nothing is compressed with openfiles=off\n");
+        gzip = 0;
+    }
+
+    if(cf.multi_reactor) {
+        // init log
+        LOG_INIT(cf.logdir, cf.progname, cf.loglevel);
+
+        // init timer
+        event_timer_init(timer_type);
+
+        // the file cache builds headers with Vary and the MIME type
+        http_gzip_init(gzip, gzip_static, gzip_cache);
+
+        if(http_mime_init(cf.mime_types) < 0) {
+            printf("read mime types error\n");
+            return 0;
+        }
+
+        if(file_cache_init(open_files, cf.open_file_valid, cf.root, hot_cache, hot_file_max) < 0) {
+            printf("file cache init error\n");
+            return 0;
+        }
+
+        reactor_t *reactors = reactor_init(cf.thread_num, &cf);
+        if(reactors == NULL) {
+            printf("start reactors error\n");
+            return 0;
+        }
+
+        LOG_INFO("httpserver started with %d reactors.", cf.thread_num);
+        reactor_wait(reactors, cf.thread_num);
+
+        return 0;
+    }
+
     /*
     * initialize listening socket
     */
-    int listenfd = open_listenfd(cf.port);
+    int listenfd = open_listenfd(cf.port, 0);
+    set_socket_non_blocking(listenfd);
 
     /*
     * create epoll and add listenfd to ep
@@ -106,21 +188,53 @@ int main(int argc, char* argv[]) {
     epfd = Epoll_Create(0);
     struct epoll_event event;
 
+    events = (struct epoll_event *)tc_malloc(sizeof(struct epoll_event) * MAXEVENTS);
+    if(events == NULL) {
+        printf("memory error\n");
+        return 0;
+    }
+
+    /* the dispatcher owns the timers, workers post to it */
+    timer_shard_t *timers = (timer_shard_t *)tc_malloc(sizeof(timer_shard_t));
+    if(timers == NULL || event_timer_shard_init(timers, epfd) < 0) {
+        printf("timer init error\n");
+        return 0;
+    }
+    timer_shard_self = timers;
+
     http_request_t *request = (http_request_t *)tc_malloc(sizeof(http_request_t));
     init_request_t(request, listenfd, epfd, &cf);
+    request->timer_shard = timers;
 
     event.data.ptr = (void *)request;
     event.events = EPOLLIN | EPOLLET;
     Epoll_Add(epfd, listenfd, &event);
 
     // create thread pool
-    tpool_t *tpool = tpool_init(cf.thread_num);
+    int schedule = TPOOL_ROUND_ROBIN;
+    if(cf.schedule && strcmp(cf.schedule, "workstealing") == 0) {
+        schedule = TPOOL_WORK_STEALING;
+    }
+    tpool_t *tpool = tpool_init(cf.thread_num, schedule, cf.queue_power);
 
     // init log
     LOG_INIT(cf.logdir, cf.progname, cf.loglevel);
 
     // init timer
-    event_timer_init();
+    event_timer_init(timer_type);
+
+    // the file cache builds headers with Vary and the MIME type
+    http_gzip_init(gzip, gzip_static, gzip_cache);
+
+    if(http_mime_init(cf.mime_types) < 0) {
+        printf("read mime types error\n");
+        return 0;
+    }
+
+    if(file_cache_init(open_files, cf.open_file_valid, cf.root, hot_cache, hot_file_max) < 0) {
+        printf("file cache init error\n");
+        return 0;
+    }
 
     LOG_INFO("httpserver started.");
     uint64_t timer;
@@ -131,18 +245,27 @@ int main(int argc, char* argv[]) {
     {   
         timer = event_find_timer();
         nready = Epoll_Wait(epfd, events, MAXEVENTS, timer);
+        clock_update();
+        event_process_posted();
 
         for(int i = 0; i < nready; i++) {
+            if(events[i].data.ptr == (void *)timers) {
+                continue;
+            }
+
             http_request_t *r = (http_request_t *)events[i].data.ptr;
             fd = r->fd;
 
             if(fd == listenfd) {  
-                tpool_add_work(tpool, handle_conn, (void *)&listenfd);
+                dispatch(tpool, handle_conn, (void *)r);
             } else {
-                if(events[i].events & EPOLLIN) {
-                    tpool_add_work(tpool, handle_read, (void *)r);
-                } else if(events[i].events & EPOLLOUT) {
-                    tpool_add_work(tpool, handle_write, (void *)r);
+                /* errors and hangups show up in read/write */
+                /* the shard belongs to this thread, mark it here */
+                event_busy_timer(r);
+                if(r->conn_state == HTTP_CONN_READ) {
+                    dispatch(tpool, handle_read, (void *)r);
+                } else {
+                    dispatch(tpool, handle_write, (void *)r);
                 }
             }
         }
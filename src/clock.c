@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "clock.h"
+
+uint64_t         clock_cached_msec;
+clock_time_t    *clock_cached_time;
+
+static clock_time_t clock_slots[CLOCK_SLOTS];
+static int clock_slot;
+static int clock_lock;
+
+static const char *week[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+void clock_http_date(time_t t, char *buf)
+{
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+
+    /* strftime depends on the locale */
+    sprintf(buf, "%s, %02d %s %4d %02d:%02d:%02d GMT",
+            week[tm.tm_wday], tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900,
+            tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+/*
+*   "Sun, 06 Nov 1994 08:49:37 GMT". The day of the week is not checked and
+*   the date is turned into seconds by hand: timegm and strptime are slow
+*   and mktime takes the time zone lock
+*/
+time_t clock_parse_http_date(const char *p, size_t len)
+{
+    int day, mon, year, hour, min, sec, m, y;
+    long days;
+
+    if (len != CLOCK_HTTP_DATE_LEN || p[3] != ',' || p[4] != ' ' || p[7] != ' '
+        || p[11] != ' ' || p[16] != ' ' || p[19] != ':' || p[22] != ':'
+        || memcmp(p + 25, " GMT", 4) != 0) {
+        return -1;
+    }
+
+    for (mon = 0; mon < 12; mon++) {
+        if (memcmp(p + 8, months[mon], 3) == 0) {
+            break;
+        }
+    }
+
+    for (int i = 0; i < 29; i++) {
+        if ((i == 5 || i == 6 || i == 12 || i == 13 || i == 14 || i == 15
+             || i == 17 || i == 18 || i == 20 || i == 21 || i == 23 || i == 24)
+            && (p[i] < '0' || p[i] > '9')) {
+            return -1;
+        }
+    }
+
+    if (mon == 12) {
+        return -1;
+    }
+
+    day = (p[5] - '0') * 10 + (p[6] - '0');
+    year = (p[12] - '0') * 1000 + (p[13] - '0') * 100 + (p[14] - '0') * 10 + (p[15] - '0');
+    hour = (p[17] - '0') * 10 + (p[18] - '0');
+    min = (p[20] - '0') * 10 + (p[21] - '0');
+    sec = (p[23] - '0') * 10 + (p[24] - '0');
+
+    if (day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60 || year < 1970) {
+        return -1;
+    }
+
+    /* days since the epoch of a proleptic Gregorian date, March based */
+    m = mon + 1;
+    y = year - (m <= 2);
+    days = 365L * y + y / 4 - y / 100 + y / 400
+           + (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + day - 1 - 719468;
+
+    return (time_t)days * 86400 + hour * 3600 + min * 60 + sec;
+}
+
+void clock_init(void)
+{
+    clock_update();
+}
+
+void clock_update(void)
+{
+    struct timeval tv;
+    struct tm tm;
+    clock_time_t *tp;
+
+    /* another loop is updating right now, its value is just as good */
+    if (__atomic_exchange_n(&clock_lock, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    gettimeofday(&tv, NULL);
+
+    tp = clock_cached_time;
+
+    if (tp == NULL || tp->sec != tv.tv_sec) {
+        clock_slot = (clock_slot + 1) % CLOCK_SLOTS;
+        tp = &clock_slots[clock_slot];
+
+        tp->sec = tv.tv_sec;
+        clock_http_date(tv.tv_sec, tp->http_date);
+
+        localtime_r(&tv.tv_sec, &tm);
+        tp->year = tm.tm_year + 1900;
+        tp->mon = tm.tm_mon + 1;
+        tp->day = tm.tm_mday;
+        tp->hour = tm.tm_hour;
+        tp->min = tm.tm_min;
+        tp->tm_sec = tm.tm_sec;
+        /* bounded, so the compiler can tell the date fits log_date */
+        snprintf(tp->log_date, CLOCK_LOG_DATE_LEN + 1, "%04u-%02u-%02u %02u:%02u:%02u",
+                 (unsigned)tp->year % 10000, (unsigned)tp->mon % 100, (unsigned)tp->day % 100,
+                 (unsigned)tp->hour % 100, (unsigned)tp->min % 100, (unsigned)tp->tm_sec % 100);
+
+        /* the slot is complete before anyone can see it */
+        __atomic_store_n(&clock_cached_time, tp, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&clock_cached_msec,
+                     (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&clock_lock, 0, __ATOMIC_RELEASE);
+}
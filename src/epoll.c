@@ -1,5 +1,7 @@
 #include <unistd.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <google/tcmalloc.h>
 #include <errno.h>
 #include "epoll.h"
@@ -7,24 +9,57 @@
 int epfd;
 struct epoll_event *events;
 
+static int epoll_create_fd(int flags) {
+    return epoll_create1(flags);
+}
+
+static int epoll_ctl_fd(int epfd, int op, int fd, struct epoll_event *event) {
+    return epoll_ctl(epfd, op, fd, event);
+}
+
+static int epoll_wait_fd(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+    return epoll_wait(epfd, events, maxevents, timeout);
+}
+
+event_backend_t epoll_backend = {
+    "epoll",
+    epoll_create_fd,
+    epoll_ctl_fd,
+    epoll_wait_fd
+};
+
+static event_backend_t *backend = &epoll_backend;
+
+int event_backend_select(const char *name) {
+    if(name == NULL || strcmp(name, epoll_backend.name) == 0) {
+        backend = &epoll_backend;
+        return 0;
+    }
+
+    if(strcmp(name, uring_backend.name) == 0) {
+        backend = &uring_backend;
+        return 0;
+    }
+
+    return -1;
+}
+
+event_backend_t *event_backend_selected(void) {
+    return backend;
+}
+
 int Epoll_Create(int flags) {
-    int fd = epoll_create1(flags);
+    int fd = backend->create(flags);
     if(fd < 0) {
         perror("epoll_create error");
         return -1;
     }
 
-    events = (struct epoll_event *)tc_malloc(sizeof(struct epoll_event) * MAXEVENTS);
-    if(events == NULL) {
-        perror("memory error");
-        return -1;
-    }
-
     return fd;
 }
 
 void Epoll_Add(int epfd, int fd, struct epoll_event *event) {
-    int ret = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, event);
+    int ret = backend->ctl(epfd, EPOLL_CTL_ADD, fd, event);
     if(ret < 0) {
         perror("epoll_add error");
     }
@@ -32,7 +67,7 @@ void Epoll_Add(int epfd, int fd, struct epoll_event *event) {
 }
 
 void Epoll_Mod(int epfd, int fd, struct epoll_event *event) {
-    int ret = epoll_ctl(epfd, EPOLL_CTL_MOD, fd, event);
+    int ret = backend->ctl(epfd, EPOLL_CTL_MOD, fd, event);
     if(ret < 0) {
         perror("epoll_mod error");
     }
@@ -40,7 +75,7 @@ void Epoll_Mod(int epfd, int fd, struct epoll_event *event) {
 }
 
 void Epoll_Del(int epfd, int fd, struct epoll_event *event) {
-    int ret = epoll_ctl(epfd, EPOLL_CTL_DEL, fd, event);
+    int ret = backend->ctl(epfd, EPOLL_CTL_DEL, fd, event);
     if(ret < 0) {
         perror("epoll_del error");
     }
@@ -48,9 +83,9 @@ void Epoll_Del(int epfd, int fd, struct epoll_event *event) {
 }
 
 int Epoll_Wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
-    int n = epoll_wait(epfd, events, maxevents, timeout);
+    int n = backend->wait(epfd, events, maxevents, timeout);
     if(n < 0) {
         return -1;
     }
     return n;
-}
\ No newline at end of file
+}
@@ -0,0 +1,615 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <gperftools/tcmalloc.h>
+
+#include "file_cache.h"
+#include "http.h"
+#include "http_gzip.h"
+#include "http_mime.h"
+#include "clock.h"
+#include "ring_log.h"
+
+typedef struct file_cache_shard_s {
+    pthread_mutex_t         lock;
+    file_cache_entry_t    **buckets;
+    uint32_t                mask;
+    list_head               lru;        /* most recently used first */
+    int                     count;
+    int                     max;
+} file_cache_shard_t;
+
+static file_cache_shard_t file_cache_shards[FILE_CACHE_SHARDS];
+static int      file_cache_max;         /* 0 if the cache is off */
+static uint64_t file_cache_valid;       /* ms */
+
+static size_t   file_cache_hot;         /* byte budget of hot objects */
+static size_t   file_cache_hot_file;    /* largest hot file */
+static size_t   file_cache_hot_used;
+static uint64_t file_cache_gen;         /* bumped by every invalidation */
+
+/* owned by the watch thread once it runs */
+static int      file_cache_ifd = -1;
+static char   **file_cache_watch_dirs;  /* directory of every inotify wd */
+static int      file_cache_nwatch;
+
+#define FILE_CACHE_WATCH_MASK   (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE \
+                                 | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO      \
+                                 | IN_DELETE_SELF | IN_MOVE_SELF)
+
+static uint64_t file_cache_hits;
+static uint64_t file_cache_misses;
+static time_t   file_cache_next_report;
+
+static int file_cache_watch_init(const char *root);
+
+int file_cache_init(int max, int valid, const char *root, size_t hot, size_t hot_file)
+{
+    file_cache_shard_t *shard;
+    uint32_t size;
+
+    file_cache_max = max > 0 ? max : 0;
+    /* a hot object lives as long as its entry, never without the table */
+    file_cache_hot = file_cache_max ? hot : 0;
+    file_cache_hot_file = hot_file;
+    file_cache_valid = (uint64_t)(valid > 0 ? valid : FILE_CACHE_VALID_DEFAULT) * 1000;
+    file_cache_next_report = clock_time()->sec + FILE_CACHE_REPORT;
+
+    for (int i = 0; i < FILE_CACHE_SHARDS && file_cache_max; i++) {
+        shard = &file_cache_shards[i];
+
+        pthread_mutex_init(&shard->lock, NULL);
+        INIT_LIST_HEAD(&shard->lru);
+        shard->count = 0;
+        shard->max = (file_cache_max + FILE_CACHE_SHARDS - 1) / FILE_CACHE_SHARDS;
+
+        /* about one entry per bucket when the shard is full */
+        for (size = 8; size < (uint32_t)shard->max; size <<= 1) {
+            /* void */
+        }
+
+        shard->buckets = (file_cache_entry_t **)tc_calloc(size, sizeof(file_cache_entry_t *));
+        if (shard->buckets == NULL) {
+            return -1;
+        }
+        shard->mask = size - 1;
+    }
+
+    LOG_INFO("file cache: %d entries, valid %d s, hot %zu bytes, files up to %zu bytes",
+             file_cache_max, (int)(file_cache_valid / 1000), file_cache_hot, file_cache_hot_file);
+
+    if (file_cache_max && root && file_cache_watch_init(root) < 0) {
+        /* not fatal, entries are still checked every openfilevalid seconds */
+        LOG_ERROR("file cache: can not watch %s", root);
+    }
+
+    return 0;
+}
+
+/* FNV-1a */
+static uint32_t file_cache_hash(const char *path, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/*
+*   read a small file into a hot object, the fd is closed once the body is
+*   in memory. The entry stays a plain fd entry when the budget is spent
+*/
+static void file_cache_load(file_cache_entry_t *fe)
+{
+    size_t off;
+    ssize_t n;
+    char *data;
+
+    if (__atomic_add_fetch(&file_cache_hot_used, fe->size, __ATOMIC_RELAXED) > file_cache_hot) {
+        __atomic_sub_fetch(&file_cache_hot_used, fe->size, __ATOMIC_RELAXED);
+        return;
+    }
+
+    /* an empty file needs no block, the headers say it all */
+    data = (char *)tc_malloc(fe->size ? fe->size : 1);
+    if (data == NULL) {
+        __atomic_sub_fetch(&file_cache_hot_used, fe->size, __ATOMIC_RELAXED);
+        return;
+    }
+
+    for (off = 0; off < (size_t)fe->size; off += n) {
+        n = pread(fe->fd, data + off, fe->size - off, off);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+
+        /* changed under us, the watcher drops the entry soon */
+        if (n <= 0) {
+            tc_free(data);
+            __atomic_sub_fetch(&file_cache_hot_used, fe->size, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    fe->data = data;
+
+    close(fe->fd);
+    fe->fd = -1;
+}
+
+/* a new entry with one reference, err is set when path can not be served */
+static file_cache_entry_t *file_cache_open(const char *path, size_t len, uint32_t hash)
+{
+    file_cache_entry_t *fe;
+    struct stat st;
+
+    fe = (file_cache_entry_t *)tc_malloc(sizeof(file_cache_entry_t) + len + 1);
+    if (fe == NULL) {
+        return NULL;
+    }
+
+    memset(fe, 0, sizeof(file_cache_entry_t));
+    memcpy(fe->name, path, len + 1);
+    fe->len = len;
+    fe->hash = hash;
+    fe->refs = 1;
+    fe->valid_until = clock_msec() + file_cache_valid;
+
+    /* open first, fstat does not walk the path again */
+    fe->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fe->fd < 0) {
+        fe->err = errno;
+        /* kept to notice a chmod when the entry is checked again */
+        if (stat(path, &st) == 0) {
+            fe->mode = st.st_mode;
+            fe->size = st.st_size;
+            fe->mtime = st.st_mtime;
+            fe->mtime_nsec = st.st_mtim.tv_nsec;
+            fe->ino = st.st_ino;
+        }
+        return fe;
+    }
+
+    if (fstat(fe->fd, &st) < 0) {
+        fe->err = errno;
+        close(fe->fd);
+        fe->fd = -1;
+        return fe;
+    }
+
+    fe->mode = st.st_mode;
+    fe->size = st.st_size;
+    fe->mtime = st.st_mtime;
+    fe->mtime_nsec = st.st_mtim.tv_nsec;
+    fe->ino = st.st_ino;
+
+    /* a directory is answered with 403, it needs no fd */
+    if (!S_ISREG(st.st_mode)) {
+        close(fe->fd);
+        fe->fd = -1;
+        return fe;
+    }
+
+    fe->mime = get_file_type(path);
+    /*
+    *   strong, unless the file was written in the current second: it can
+    *   change again without a new mtime, so it only gets a weak ETag and
+    *   is opened again once that second is over
+    */
+    if (fe->mtime >= clock_time()->sec) {
+        fe->etag[0] = 'W';
+        fe->etag[1] = '/';
+        fe->valid_until = clock_msec() + 1000;
+    }
+    sprintf(fe->etag + (fe->etag[0] == 'W' ? 2 : 0), "\"%lx-%lx-%lx\"",
+            (unsigned long)fe->ino, (unsigned long)fe->size, (unsigned long)fe->mtime);
+    clock_http_date(fe->mtime, fe->last_modified);
+    fe->vary = http_gzip_vary(fe);
+
+    fe->header_len = http_entity_header(fe, NULL, fe->header, FILE_CACHE_HEADER_LEN);
+    if (fe->header_len >= FILE_CACHE_HEADER_LEN) {
+        /* a MIME type too long for the header */
+        fe->mime = "application/octet-stream";
+        fe->header_len = http_entity_header(fe, NULL, fe->header, FILE_CACHE_HEADER_LEN);
+    }
+
+    if (file_cache_hot && (size_t)fe->size <= file_cache_hot_file) {
+        file_cache_load(fe);
+    }
+
+    return fe;
+}
+
+/* stat the path again, 1 if the entry still describes it */
+static int file_cache_unchanged(file_cache_entry_t *fe)
+{
+    struct stat st;
+
+    if (stat(fe->name, &st) < 0) {
+        return fe->err == errno;
+    }
+
+    /* a weak ETag becomes strong once the second of the mtime is over */
+    if (fe->etag[0] == 'W') {
+        return 0;
+    }
+
+    return fe->ino == st.st_ino && fe->mtime == st.st_mtime
+        && fe->mtime_nsec == st.st_mtim.tv_nsec
+        && fe->size == st.st_size && fe->mode == st.st_mode;
+}
+
+/* take fe out of the table, the caller drops the table's reference after unlocking */
+static void file_cache_unlink(file_cache_shard_t *shard, file_cache_entry_t *fe)
+{
+    file_cache_entry_t **pp = &shard->buckets[fe->hash & shard->mask];
+
+    while (*pp != fe) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = fe->hash_next;
+
+    list_del(&fe->lru);
+    fe->cached = 0;
+    shard->count--;
+}
+
+static file_cache_entry_t *file_cache_find(file_cache_shard_t *shard, const char *path,
+                                           size_t len, uint32_t hash)
+{
+    file_cache_entry_t *fe;
+
+    for (fe = shard->buckets[hash & shard->mask]; fe; fe = fe->hash_next) {
+        if (fe->hash == hash && fe->len == len && memcmp(fe->name, path, len) == 0) {
+            return fe;
+        }
+    }
+
+    return NULL;
+}
+
+static void file_cache_report(void)
+{
+    file_cache_stat_t st;
+    time_t now = clock_time()->sec;
+    time_t next = __atomic_load_n(&file_cache_next_report, __ATOMIC_RELAXED);
+
+    if (now < next || !__atomic_compare_exchange_n(&file_cache_next_report, &next,
+                            now + FILE_CACHE_REPORT, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    file_cache_stat(&st);
+    LOG_INFO("file cache: %lu entries, %lu hot bytes, %lu hits, %lu misses, hit ratio %.1f%%",
+             st.entries, st.hot_bytes, st.hits, st.misses,
+             st.hits + st.misses ? 100.0 * st.hits / (st.hits + st.misses) : 0.0);
+}
+
+file_cache_entry_t *file_cache_get(const char *path)
+{
+    file_cache_shard_t *shard;
+    file_cache_entry_t *fe, *nfe, *victims = NULL;
+    size_t len = strlen(path);
+    uint32_t hash;
+    uint64_t gen;
+
+    if (file_cache_max == 0) {
+        __atomic_add_fetch(&file_cache_misses, 1, __ATOMIC_RELAXED);
+        return file_cache_open(path, len, 0);
+    }
+
+    file_cache_report();
+
+    hash = file_cache_hash(path, len);
+    shard = &file_cache_shards[hash >> 28 & (FILE_CACHE_SHARDS - 1)];
+
+    pthread_mutex_lock(&shard->lock);
+    fe = file_cache_find(shard, path, len, hash);
+    if (fe) {
+        __atomic_add_fetch(&fe->refs, 1, __ATOMIC_RELAXED);
+        list_del(&fe->lru);
+        list_add(&fe->lru, &shard->lru);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (fe) {
+        if (clock_msec() < __atomic_load_n(&fe->valid_until, __ATOMIC_RELAXED)) {
+            __atomic_add_fetch(&file_cache_hits, 1, __ATOMIC_RELAXED);
+            return fe;
+        }
+
+        if (file_cache_unchanged(fe)) {
+            __atomic_store_n(&fe->valid_until, clock_msec() + file_cache_valid, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&file_cache_hits, 1, __ATOMIC_RELAXED);
+            return fe;
+        }
+
+        /* the file changed, replaced below */
+        file_cache_release(fe);
+    }
+
+    __atomic_add_fetch(&file_cache_misses, 1, __ATOMIC_RELAXED);
+
+    /* no syscall under the lock */
+    gen = __atomic_load_n(&file_cache_gen, __ATOMIC_ACQUIRE);
+    nfe = file_cache_open(path, len, hash);
+    if (nfe == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+
+    /* the stale entry, or one another worker opened meanwhile */
+    fe = file_cache_find(shard, path, len, hash);
+    if (fe) {
+        file_cache_unlink(shard, fe);
+        fe->hash_next = victims;
+        victims = fe;
+    }
+
+    nfe->refs++;
+    nfe->cached = 1;
+    nfe->hash_next = shard->buckets[hash & shard->mask];
+    shard->buckets[hash & shard->mask] = nfe;
+    list_add(&nfe->lru, &shard->lru);
+    shard->count++;
+
+    /* the file may have changed while it was read, check it on the next hit */
+    if (__atomic_load_n(&file_cache_gen, __ATOMIC_ACQUIRE) != gen) {
+        __atomic_store_n(&nfe->valid_until, 0, __ATOMIC_RELAXED);
+    }
+
+    while (shard->count > shard->max) {
+        fe = list_entry(shard->lru.prev, file_cache_entry_t, lru);
+        file_cache_unlink(shard, fe);
+        fe->hash_next = victims;
+        victims = fe;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    while (victims) {
+        fe = victims;
+        victims = fe->hash_next;
+        file_cache_release(fe);
+    }
+
+    return nfe;
+}
+
+void file_cache_ref(file_cache_entry_t *fe)
+{
+    __atomic_add_fetch(&fe->refs, 1, __ATOMIC_RELAXED);
+}
+
+void file_cache_release(file_cache_entry_t *fe)
+{
+    if (__atomic_sub_fetch(&fe->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    if (fe->fd >= 0) {
+        close(fe->fd);
+    }
+    if (fe->data) {
+        tc_free(fe->data);
+        __atomic_sub_fetch(&file_cache_hot_used, fe->size, __ATOMIC_RELAXED);
+    }
+    if (fe->gzip) {
+        http_gzip_free(fe->gzip);
+    }
+    tc_free(fe);
+}
+
+void file_cache_invalidate(const char *path)
+{
+    file_cache_shard_t *shard;
+    file_cache_entry_t *fe;
+    size_t len = strlen(path);
+    uint32_t hash;
+
+    if (file_cache_max == 0) {
+        return;
+    }
+
+    __atomic_add_fetch(&file_cache_gen, 1, __ATOMIC_RELEASE);
+
+    hash = file_cache_hash(path, len);
+    shard = &file_cache_shards[hash >> 28 & (FILE_CACHE_SHARDS - 1)];
+
+    pthread_mutex_lock(&shard->lock);
+    fe = file_cache_find(shard, path, len, hash);
+    if (fe) {
+        file_cache_unlink(shard, fe);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (fe) {
+        LOG_INFO("file cache: %s changed", path);
+        file_cache_release(fe);
+    }
+}
+
+/* drop every entry, after a directory moved or lost events */
+static void file_cache_invalidate_all(void)
+{
+    file_cache_shard_t *shard;
+    file_cache_entry_t *fe, *victims;
+
+    __atomic_add_fetch(&file_cache_gen, 1, __ATOMIC_RELEASE);
+
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        shard = &file_cache_shards[i];
+        victims = NULL;
+
+        pthread_mutex_lock(&shard->lock);
+        while (!list_empty(&shard->lru)) {
+            fe = list_entry(shard->lru.next, file_cache_entry_t, lru);
+            file_cache_unlink(shard, fe);
+            fe->hash_next = victims;
+            victims = fe;
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        while (victims) {
+            fe = victims;
+            victims = fe->hash_next;
+            file_cache_release(fe);
+        }
+    }
+
+    LOG_INFO("file cache: dropped all entries");
+}
+
+static int file_cache_watch_dir(const char *dir, const struct stat *st, int type, struct FTW *ftw)
+{
+    char **dirs;
+    int wd, size;
+
+    if (type != FTW_D) {
+        return 0;
+    }
+
+    wd = inotify_add_watch(file_cache_ifd, dir, FILE_CACHE_WATCH_MASK | IN_ONLYDIR);
+    if (wd < 0) {
+        LOG_ERROR("file cache: inotify_add_watch %s: %s", dir, strerror(errno));
+        return 0;
+    }
+
+    /* wds are small integers, the table is indexed by them */
+    if (wd >= file_cache_nwatch) {
+        size = file_cache_nwatch ? file_cache_nwatch : 64;
+        while (size <= wd) {
+            size <<= 1;
+        }
+
+        dirs = (char **)tc_realloc(file_cache_watch_dirs, size * sizeof(char *));
+        if (dirs == NULL) {
+            inotify_rm_watch(file_cache_ifd, wd);
+            return 0;
+        }
+        memset(dirs + file_cache_nwatch, 0, (size - file_cache_nwatch) * sizeof(char *));
+        file_cache_watch_dirs = dirs;
+        file_cache_nwatch = size;
+    }
+
+    /* the same directory again keeps its wd */
+    if (file_cache_watch_dirs[wd] == NULL) {
+        file_cache_watch_dirs[wd] = strdup(dir);
+    }
+
+    return 0;
+}
+
+static void *file_cache_watch(void *arg)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX];
+    struct inotify_event *ev;
+    const char *dir;
+    size_t len;
+    ssize_t n;
+
+    for (;;) {
+        n = read(file_cache_ifd, buf, sizeof(buf));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("file cache: inotify read: %s", strerror(errno));
+            return NULL;
+        }
+
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *)p;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                file_cache_invalidate_all();
+                continue;
+            }
+
+            if (ev->wd < 0 || ev->wd >= file_cache_nwatch
+                || (dir = file_cache_watch_dirs[ev->wd]) == NULL) {
+                continue;
+            }
+
+            if (ev->mask & IN_IGNORED) {
+                free(file_cache_watch_dirs[ev->wd]);
+                file_cache_watch_dirs[ev->wd] = NULL;
+                continue;
+            }
+
+            /* a directory moved or went away: paths under it are unknown */
+            if (ev->mask & (IN_ISDIR | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                file_cache_invalidate_all();
+
+                if (ev->len && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    snprintf(path, sizeof(path), "%s/%s", dir, ev->name);
+                    nftw(path, file_cache_watch_dir, 16, FTW_PHYS);
+                }
+                continue;
+            }
+
+            if (ev->len) {
+                snprintf(path, sizeof(path), "%s/%s", dir, ev->name);
+                file_cache_invalidate(path);
+
+                /* the file keeps its .gz sibling as its gzip variant */
+                len = strlen(path);
+                if (len > 3 && strcmp(path + len - 3, ".gz") == 0) {
+                    path[len - 3] = '\0';
+                    file_cache_invalidate(path);
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int file_cache_watch_init(const char *root)
+{
+    pthread_t tid;
+
+    file_cache_ifd = inotify_init1(IN_CLOEXEC);
+    if (file_cache_ifd < 0) {
+        return -1;
+    }
+
+    if (nftw(root, file_cache_watch_dir, 16, FTW_PHYS) < 0 || file_cache_nwatch == 0) {
+        return -1;
+    }
+
+    if (pthread_create(&tid, NULL, file_cache_watch, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+
+    LOG_INFO("file cache: watching %s", root);
+
+    return 0;
+}
+
+void file_cache_stat(file_cache_stat_t *st)
+{
+    st->hits = __atomic_load_n(&file_cache_hits, __ATOMIC_RELAXED);
+    st->misses = __atomic_load_n(&file_cache_misses, __ATOMIC_RELAXED);
+    st->entries = 0;
+    st->hot_bytes = __atomic_load_n(&file_cache_hot_used, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < FILE_CACHE_SHARDS && file_cache_max; i++) {
+        st->entries += __atomic_load_n(&file_cache_shards[i].count, __ATOMIC_RELAXED);
+    }
+}
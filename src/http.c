@@ -12,88 +12,100 @@
 #include "http.h"
 #include "http_parse.h"
 #include "http_request.h"
+#include "http_gzip.h"
+#include "http_uring.h"
 #include "util.h"
 #include "timer.h"
+#include "clock.h"
 #include "epoll.h"
 #include "ring_log.h"
 
-extern int epfd;
 extern conf_t cf;
 extern char conf_buf[BUFLEN];
 
-static const char* get_file_type(const char *type);
 static void parse_uri(char *uri, int length, char *filename, char *querystring);
-static void do_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
-static void serve_static(int fd, char *filename, size_t filesize, http_out_t *out);
+static int do_error(http_out_t *out, char *cause, char *errnum, char *shortmsg, char *longmsg);
+static int serve_static(file_cache_entry_t *fe, http_out_t *out);
+static int serve_ranges(file_cache_entry_t *fe, http_out_t *out, http_range_t *ranges, int n);
 static char *ROOT = NULL;
 
+#define http_cpymem(dst, src, n)    ((char *)memcpy(dst, src, n) + (n))
+#define http_str_(x)                #x
+#define http_str(x)                 http_str_(x)
+#define HTTP_KEEP_ALIVE_HEADER      "Connection: keep-alive\r\n" \
+                                    "Keep-Alive: timeout=" http_str(TIMEOUT_DEFAULT_SEC) "\r\n"
 
-mime_type_t mime[] = {
-    {".html", "text/html"},
-    {".xml", "text/xml"},
-    {".xhtml", "application/xhtml+xml"},
-    {".txt", "text/plain"},
-    {".rtf", "application/rtf"},
-    {".pdf", "application/pdf"},
-    {".word", "application/msword"},
-    {".png", "image/png"},
-    {".gif", "image/gif"},
-    {".jpg", "image/jpeg"},
-    {".jpeg", "image/jpeg"},
-    {".au", "audio/basic"},
-    {".mpeg", "video/mpeg"},
-    {".mpg", "video/mpeg"},
-    {".avi", "video/x-msvideo"},
-    {".gz", "application/x-gzip"},
-    {".tar", "application/x-tar"},
-    {".css", "text/css"},
-    {NULL ,"text/plain"}
-};
 
+http_request_t *http_init_conn(http_request_t *listen_request, int sockfd) {
+    http_request_t *request = (http_request_t *)tc_malloc(sizeof(http_request_t));
+    if(request == NULL) {
+        LOG_ERROR("memory error");
+        close(sockfd);
+        return NULL;
+    }
+
+    init_request_t(request, sockfd, listen_request->epfd, &cf);
+
+    request->buf = http_ring_alloc();
+    if(request->buf == NULL) {
+        LOG_ERROR("ring buffer error");
+        close(sockfd);
+        free_request_t(request);
+        return NULL;
+    }
+
+    request->timer_shard = listen_request->timer_shard;
+
+    return request;
+}
 
 void handle_conn(void *ptr) {
-    int listenfd = *(int *)ptr;
+    http_request_t *listen_request = (http_request_t *)ptr;
+    http_request_t *request;
+    int listenfd = listen_request->fd;
+    int epfd = listen_request->epfd;
     struct sockaddr_in cliaddr;
-    socklen_t len = 1;
+    socklen_t len;
     struct epoll_event event;
-    int ret;
 
-    int sockfd = Accept(listenfd, (struct sockaddr *)&cliaddr, &len);
-    if(sockfd < 0) {
-        /* impossibly happen */
-        if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+    /*
+    *   listenfd is edge triggered and non blocking, so drain the accept
+    *   queue until EAGAIN, otherwise the remaining connections are lost
+    */
+    for(;;) {
+        len = sizeof(cliaddr);
+        int sockfd = accept4(listenfd, (struct sockaddr *)&cliaddr, &len, SOCK_NONBLOCK);
+        if(sockfd < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                LOG_ERROR("accept error");
+            }
             return;
-        } else {
-            LOG_ERROR("accept error");
+        }
+
+        LOG_INFO("new connection fd %d", sockfd);
+
+        request = http_init_conn(listen_request, sockfd);
+        if(request == NULL) {
             return;
         }
-    }
 
-    ret = set_socket_non_blocking(sockfd);
-    if(ret != 0) {
-        LOG_ERROR("socket %d set_socket_blocking error", sockfd);
-    }
-    LOG_INFO("new connection fd %d", sockfd);
+        event.data.ptr = (void *)request;
+        event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
 
-    http_request_t *request = (http_request_t *)tc_malloc(sizeof(http_request_t));
-    if(request == NULL) {
-        LOG_ERROR("memory error");
-        return;
-    }
-    
-    init_request_t(request, sockfd, epfd, &cf);
-    event.data.ptr = (void *)request;
-    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+        /* add timer before the fd is armed, or a worker may see the read event first */
+        event_add_timer(request, TIMEOUT_DEFAULT);
 
-    Epoll_Add(epfd, sockfd, &event);
-    
-    /* add timer */
-    event_add_timer(request, TIMEOUT_DEFAULT);
+        Epoll_Add(epfd, sockfd, &event);
+    }
 }
 
 void handle_read(void *ptr) {
     http_request_t *request = (http_request_t *)ptr;
     int fd = request->fd;
+    int epfd = request->epfd;
     int ret;
     ssize_t n;
     ROOT = request->root;
@@ -102,25 +114,22 @@ void handle_read(void *ptr) {
     size_t remain_size;
 
     struct epoll_event event = {0, {0}};
-    event.data.ptr = ptr;
-    Epoll_Del(epfd, fd, &event);
-
-    /* delete timer */
-    if(event_del_timer(request) < 0) {
-        /* delete failed */
-        tc_free(request);
-        return;
-    }
 
     for(;;) {
-        plast = &request->buf[request->last % MAX_BUF];
-        remain_size = MIN(MAX_BUF - (request->last - request->pos) - 1, MAX_BUF - request->last % MAX_BUF);
-
-        n = Read(fd, plast, remain_size);
-        if(request->last - request->pos >= MAX_BUF) {
+        /*
+        *   the request being parsed must not be overwritten, pipelined ones
+        *   wait in the socket. The free space is contiguous, one read fills it
+        */
+        plast = http_ring_at(request, request->last);
+        remain_size = MAX_BUF - (request->last - request->begin);
+        if(remain_size == 0) {
             LOG_ERROR("request buffer overflow!");
+            goto err;
         }
 
+        n = request->uring.on ? http_uring_read(request, plast, remain_size)
+                              : Read(fd, plast, remain_size);
+
         if(n == 0) {
             // EOF
             LOG_INFO("fd %d finished", fd);
@@ -132,39 +141,53 @@ void handle_read(void *ptr) {
                 LOG_ERROR("read error");
                 goto err;
             }
-            break;
+
+            /* wait for the rest of the request */
+            event_add_timer(request, TIMEOUT_DEFAULT);
+
+            if(request->uring.on) {
+                if(http_uring_wait_read(request) < 0) {
+                    goto err;
+                }
+                return;
+            }
+
+            event.data.ptr = ptr;
+            event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+
+            Epoll_Mod(epfd, fd, &event);
+            return;
         }
         
         request->last += n;
-        if(request->last - request->pos >= MAX_BUF) {
-            LOG_ERROR("request buffer overflow!");
-        }
 
-        LOG_INFO("ready to parse request line");
-        ret = http_parse_request_line(request);
-        if(ret == AGAIN) {
-            continue;
-        } else if (ret != RETURN_OK){
+        /* a body is consumed while it arrives and frees the ring again */
+        LOG_INFO("ready to parse request");
+        ret = http_parse_request(request);
+        if(ret == RETURN_OK) {
+            break;
+        } else if (ret != AGAIN){
             LOG_ERROR("rc != OK");
             goto err;
         }
+    }
 
-        LOG_INFO("method == %.*s", (int)(request->method_end - request->request_start), (char *)request->request_start);
-        LOG_INFO("uri == %.*s", (int)(request->uri_end - request->uri_start), (char *)request->uri_start);
+    LOG_INFO("method == %.*s", (int)(request->method_end - request->request_start), (char *)request->request_start);
+    LOG_INFO("uri == %.*s", (int)(request->uri_end - request->uri_start), (char *)request->uri_start);
 
-        ret = http_parse_request_body(request);
-        if(ret == AGAIN) {
-            continue;
-        } else if (ret != RETURN_OK){
-            LOG_ERROR("rc != OK");
-            goto err;
-        }
+    /* the oneshot registration has fired, re-arm it for writing */
+    request->conn_state = HTTP_CONN_WRITE;
+
+    /* on the ring the sends wait for the socket themselves */
+    if(request->uring.on) {
+        handle_write(ptr);
+        return;
     }
 
     event.data.ptr = ptr;
     event.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
     
-    Epoll_Add(epfd, fd, &event);
+    Epoll_Mod(epfd, fd, &event);
 
     return;
 
@@ -175,71 +198,157 @@ err:
     }
 }
 
+/* queue the response to the parsed request, returns -1 if the chain failed */
+static int http_respond(http_request_t *request, http_out_t *out) {
+    char filename[SHORTLINE];
+    file_cache_entry_t *fe;
+
+    /* the next response of the pipeline starts right after the headers */
+    out->header_only = request->method == HTTP_HEAD;
+
+    if(request->err_status == HTTP_REQUEST_ENTITY_TOO_LARGE) {
+        return do_error(out, "request body", "413", "Request Entity Too Large",
+                "httpserver refuses a body larger than maxbody");
+    }
+
+    parse_uri(request->uri_start, request->uri_end - request->uri_start, filename, NULL);
+
+    /* fd, size and mtime from the open file cache */
+    fe = file_cache_get(filename);
+    if (fe == NULL) {
+        return RETURN_ERROR;
+    }
+
+    if (fe->err != 0 && fe->err != EACCES) {
+        file_cache_release(fe);
+        return do_error(out, filename, "404", "Not Found", "httpserver can't find the file");
+    }
+
+    if (fe->err == EACCES || !(S_ISREG(fe->mode)) || !(S_IRUSR & fe->mode))
+    {
+        file_cache_release(fe);
+        return do_error(out, filename, "403", "Forbidden",
+                "httpserver can't read the file");
+    }
+
+    http_handle_header(request, out);
+
+    if(out->status == 0) {
+        out->status = HTTP_OK;
+    }
+
+    return serve_static(fe, out);
+}
+
+/* send the chain, or submit it to the ring of the reactor: AGAIN until it is sent */
+static int http_flush(http_request_t *r) {
+    return r->uring.on ? http_uring_flush(r) : http_chain_flush(r->chain);
+}
 
 void handle_write(void *ptr) {
     http_request_t *request = (http_request_t *)ptr;
     int fd = request->fd;
+    int epfd = request->epfd;
     int ret;
-    char filename[SHORTLINE];
-    struct stat sbuf;
+    http_out_t out;
+    http_chain_t *chain = request->chain;
 
     struct epoll_event event = {0, {0}};
-    event.data.ptr = ptr;
-    Epoll_Del(epfd, fd, &event);
+
+    /* the chain only lives while there is output, idle connections have none */
+    if(chain == NULL) {
+        chain = (http_chain_t *)tc_malloc(sizeof(http_chain_t));
+        if(chain == NULL) {
+            LOG_ERROR("no enough space for http_chain_t");
+            goto fin;
+        }
+
+        http_chain_init(chain, fd);
+        request->chain = chain;
+    }
 
     /*
-    *   handle http header
+    *   answer every complete request in the buffer in order, a pipelining
+    *   client gets all the responses with a few sends. A full chain is sent
+    *   first, the requests not answered yet stay parsed in the ring
     */
-    http_out_t *out = (http_out_t *)tc_malloc(sizeof(http_out_t));
-    if (out == NULL) {
-        LOG_ERROR("no enough space for http_out_t");
-        exit(1);
-    }
+    while(request->keep_alive && request->parse_phase == HTTP_PARSE_DONE) {
+        if(!http_chain_room(chain)) {
+            ret = http_flush(request);
+            if(ret == AGAIN) {
+                goto again;
+            } else if(ret != RETURN_OK) {
+                LOG_ERROR("send response error");
+                goto fin;
+            }
+        }
 
-    ret = init_out_t(out, fd);
-    if(ret != RETURN_OK) {
-        LOG_ERROR("init http_out_t error");
-    }
-    
-    parse_uri(request->uri_start, request->uri_end - request->uri_start, filename, NULL);
+        init_out_t(&out, fd);
+        out.chain = chain;
 
-    if(stat(filename, &sbuf) < 0) {
-        do_error(fd, filename, "404", "Not Found", "httpserver can't find the file");
-        goto fin;
+        ret = http_respond(request, &out);
+        request->keep_alive = (ret == RETURN_OK) && out.keep_alive;
+
+        reset_request_t(request);
+
+        if(!request->keep_alive) {
+            LOG_INFO("no keep_alive! ready to close");
+            break;
+        }
+
+        ret = http_parse_request(request);
+        if(ret != RETURN_OK && ret != AGAIN) {
+            request->keep_alive = 0;
+        }
     }
 
-    if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode))
-    {
-        do_error(fd, filename, "403", "Forbidden",
-                "httpserver can't read the file");
+    ret = http_flush(request);
+    if(ret == AGAIN) {
+        goto again;
+    } else if(ret != RETURN_OK) {
+        LOG_ERROR("send response error");
         goto fin;
     }
 
-    out->mtime = sbuf.st_mtime;
+    tc_free(chain);
+    request->chain = NULL;
 
-    http_handle_header(request, out);
-    if(list_empty(&(request->list)) == 0) {
-        LOG_ERROR("After handle, header list should be empty");
+    if(!request->keep_alive) {
+        goto fin;
     }
 
-    if(out->status == 0) {
-        out->status = HTTP_OK;
-    }
+    event_add_timer(request, TIMEOUT_DEFAULT);
 
-    serve_static(fd, filename, sbuf.st_size, out);
+    request->conn_state = HTTP_CONN_READ;
 
-    if(!out->keep_alive) {
-        LOG_INFO("no keep_alive! ready to close");
-        free_out_t(out);
-        goto fin;
+    if(request->uring.on) {
+        if(http_uring_wait_read(request) < 0) {
+            goto fin;
+        }
+        return;
     }
 
     event.data.ptr = ptr;
     event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
 
-    Epoll_Add(epfd, fd, &event);
+    Epoll_Mod(epfd, fd, &event);
+
+    return;
+
+again:
+    /* the send buffer is full, go on where the chain stopped on EPOLLOUT */
     event_add_timer(request, TIMEOUT_DEFAULT);
 
+    /* on the ring the completion of the chain comes back here */
+    if(request->uring.on) {
+        return;
+    }
+
+    event.data.ptr = ptr;
+    event.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
+
+    Epoll_Mod(epfd, fd, &event);
+
     return;
 
 fin:
@@ -293,101 +402,391 @@ static void parse_uri(char *uri, int uri_length, char *filename, char *querystri
     return;
 }
 
-static void do_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
+static int do_error(http_out_t *out, char *cause, char *errnum, char *shortmsg, char *longmsg)
 {
     char header[MAXLINE], body[MAXLINE];
+    char *p;
+    size_t body_len;
+
+    snprintf(body, MAXLINE,
+             "<html><title>HXH Error</title>"
+             "<body bgcolor=""ffffff"">\n"
+             "%s: %s\n"
+             "<p>%s: %s\n</p>"
+             "<hr><em>HXH web server</em>\n</body></html>",
+             errnum, shortmsg, longmsg, cause);
+    body_len = strlen(body);
+
+    p = header + sprintf(header, "HTTP/1.1 %s %s\r\n", errnum, shortmsg);
+    p = http_cpymem(p, "Date: ", sizeof("Date: ") - 1);
+    p = http_cpymem(p, clock_time()->http_date, CLOCK_HTTP_DATE_LEN);
+    p = http_cpymem(p, "\r\n", 2);
+    p = http_cpymem(p, "Server: HXH\r\n", sizeof("Server: HXH\r\n") - 1);
+    p = http_cpymem(p, "Content-type: text/html\r\n", sizeof("Content-type: text/html\r\n") - 1);
+    p = http_cpymem(p, "Connection: close\r\n", sizeof("Connection: close\r\n") - 1);
+    p += sprintf(p, "Content-length: %zu\r\n\r\n", body_len);
+
+    /* the connection is closed after the error */
+    out->keep_alive = 0;
+
+    if (http_chain_copy(out->chain, header, p - header) != RETURN_OK) {
+        return RETURN_ERROR;
+    }
 
-    sprintf(body, "<html><title>HXH Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\n", body);
-    sprintf(body, "%s%s: %s\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\n</p>", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>HXH web server</em>\n</body></html>", body);
-
-    sprintf(header, "HTTP/1.1 %s %s\r\n", errnum, shortmsg);
-    sprintf(header, "%sServer: HXH\r\n", header);
-    sprintf(header, "%sContent-type: text/html\r\n", header);
-    sprintf(header, "%sConnection: close\r\n", header);
-    sprintf(header, "%sContent-length: %d\r\n\r\n", header, (int)strlen(body));
-    
-    Write(fd, header, strlen(header));
-    Write(fd, body, strlen(body));
-    
-    return;
+    if (out->header_only) {
+        return RETURN_OK;
+    }
+
+    return http_chain_copy(out->chain, body, body_len);
 }
 
 
-static void serve_static(int fd, char *filename, size_t filesize, http_out_t *out) {
-    char header[MAXLINE];
-    char buf[SHORTLINE];
-    ssize_t n;
-    struct tm tm;
-    
-    const char *file_type;
-    const char *dot_pos = strrchr(filename, '.');
-    file_type = get_file_type(dot_pos);
+/* the headers of the connection, after the status line and the headers of the file */
+static size_t http_conn_header(http_out_t *out, char *buf) {
+    char *p = buf;
 
-    sprintf(header, "HTTP/1.1 %d %s\r\n", out->status, get_shortmsg_from_status_code(out->status));
+    p = http_cpymem(p, "Date: ", sizeof("Date: ") - 1);
+    p = http_cpymem(p, clock_time()->http_date, CLOCK_HTTP_DATE_LEN);
+    p = http_cpymem(p, "\r\n", 2);
 
     if (out->keep_alive) {
-        sprintf(header, "%sConnection: keep-alive\r\n", header);
-        sprintf(header, "%sKeep-Alive: timeout=%d\r\n", header, TIMEOUT_DEFAULT);
+        p = http_cpymem(p, HTTP_KEEP_ALIVE_HEADER, sizeof(HTTP_KEEP_ALIVE_HEADER) - 1);
+    }
+
+    p = http_cpymem(p, "Server: HXH\r\n\r\n", sizeof("Server: HXH\r\n\r\n") - 1);
+
+    return p - buf;
+}
+
+/*
+*   If-Range holds the ETag or the Last-Modified of the file the client has
+*   part of. It takes a strong comparison, a weak ETag never matches
+*/
+static int http_if_range(file_cache_entry_t *fe, http_out_t *out) {
+    size_t len = out->if_range_len;
+
+    if (out->if_range == NULL) {
+        return 1;
     }
 
-    if (out->modified) {
-        sprintf(header, "%sContent-type: %s\r\n", header, file_type);
-        sprintf(header, "%sContent-length: %zu\r\n", header, filesize);
-        localtime_r(&(out->mtime), &tm);
-        strftime(buf, SHORTLINE,  "%a, %d %b %Y %H:%M:%S GMT", &tm);
-        sprintf(header, "%sLast-Modified: %s\r\n", header, buf);
+    if (out->if_range[0] == '"') {
+        return fe->etag[0] == '"' && len == strlen(fe->etag) && memcmp(out->if_range, fe->etag, len) == 0;
     }
 
-    sprintf(header, "%sServer: HXH\r\n", header);
-    sprintf(header, "%s\r\n", header);
+    return len == CLOCK_HTTP_DATE_LEN && memcmp(out->if_range, fe->last_modified, len) == 0;
+}
 
-    n = Write(fd, header, strlen(header));
-    
-    if (n != strlen(header)) {
-        LOG_ERROR("n != strlen(header)");
-        goto fin; 
+/* the entity tag without W/, weak comparison ignores it */
+static const char *http_etag_opaque(const char *p, size_t *len) {
+    if (*len > 2 && p[0] == 'W' && p[1] == '/') {
+        *len -= 2;
+        return p + 2;
     }
 
-    if (!out->modified) {
-        goto fin;
+    return p;
+}
+
+/* 1 if the list of If-None-Match has etag or is "*" */
+static int http_etag_match(const char *p, size_t len, const char *etag) {
+    const char *last = p + len, *tag, *end;
+    size_t etag_len = strlen(etag), tag_len;
+
+    etag = http_etag_opaque(etag, &etag_len);
+
+    while (p < last) {
+        while (p < last && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+
+        if (p == last) {
+            break;
+        }
+
+        if (*p == '*') {
+            return 1;
+        }
+
+        /* W/"...": the tag runs to the closing quote */
+        tag = p;
+        if (last - p > 2 && p[0] == 'W' && p[1] == '/') {
+            p += 2;
+        }
+        if (p == last || *p != '"') {
+            return 0;
+        }
+        end = memchr(p + 1, '"', last - p - 1);
+        if (end == NULL) {
+            return 0;
+        }
+        p = end + 1;
+
+        tag_len = p - tag;
+        tag = http_etag_opaque(tag, &tag_len);
+        if (tag_len == etag_len && memcmp(tag, etag, tag_len) == 0) {
+            return 1;
+        }
     }
 
-    int srcfd = open(filename, O_RDONLY, 0);
-    if(srcfd < 0) {
-        perror("open file error");
-        goto fin;
+    return 0;
+}
+
+/*
+*   1 if the copy of the client is current. If-None-Match wins over
+*   If-Modified-Since. A client echoing Last-Modified sends the very string
+*   cached in fe, so most revalidations are one memcmp; other dates are
+*   parsed, and a later one means not modified as well
+*/
+static int http_not_modified(file_cache_entry_t *fe, const char *etag, http_out_t *out) {
+    time_t t;
+
+    if (out->if_none_match) {
+        return http_etag_match(out->if_none_match, out->if_none_match_len, etag);
     }
-    // can use sendfile
-    char *srcaddr = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    if(srcaddr == NULL) {
-        perror("mmap error");
-        close(srcfd);
-        goto fin;
+
+    if (out->if_modified_since == NULL) {
+        return 0;
     }
-    close(srcfd);
 
-    n = Write(fd, srcaddr, filesize);
+    if (out->if_modified_since_len == CLOCK_HTTP_DATE_LEN
+        && memcmp(out->if_modified_since, fe->last_modified, CLOCK_HTTP_DATE_LEN) == 0) {
+        return 1;
+    }
 
-    munmap(srcaddr, filesize);
+    t = clock_parse_http_date(out->if_modified_since, out->if_modified_since_len);
 
-fin:
-    return;
+    return t != -1 && fe->mtime <= t;
 }
 
+/* 304 with the validators of the entity the client would have got */
+static int serve_not_modified(file_cache_entry_t *fe, const char *etag, int vary, http_out_t *out) {
+    char header[MAXLINE];
+    char *p = header;
 
-static const char* get_file_type(const char *type)
-{
-    if (type == NULL) {
-        return "text/plain";
+    p = http_cpymem(p, "HTTP/1.1 304 Not Modified\r\nETag: ", sizeof("HTTP/1.1 304 Not Modified\r\nETag: ") - 1);
+    p = http_cpymem(p, etag, strlen(etag));
+    p = http_cpymem(p, "\r\n", 2);
+    if (vary) {
+        p = http_cpymem(p, "Vary: Accept-Encoding\r\n", sizeof("Vary: Accept-Encoding\r\n") - 1);
+    }
+    p += http_conn_header(out, p);
+    file_cache_release(fe);
+
+    return http_chain_copy(out->chain, header, p - header);
+}
+
+/* len bytes of fe from offset, the link takes a reference of its own */
+static int http_static_body(http_out_t *out, file_cache_entry_t *fe, off_t offset, size_t len) {
+    file_cache_ref(fe);
+
+    if (fe->data) {
+        return http_chain_add_mem(out->chain, fe, fe->data + offset, len);
+    }
+
+    return http_chain_add_file(out->chain, fe, offset, len);
+}
+
+/*
+*   206 with the n ranges of the identity of fe, one range in place and
+*   more as multipart/byteranges, or 416 if n says none is satisfiable.
+*   The bodies go through the same sendfile and memory links as a 200
+*/
+static int serve_ranges(file_cache_entry_t *fe, http_out_t *out, http_range_t *ranges, int n) {
+    static uint64_t boundary_seq;
+    char header[MAXLINE];
+    char boundary[32];
+    size_t len, part_len, total;
+    int ret = RETURN_OK;
+
+    if (n == HTTP_PARSE_RANGE_NOT_SATISFIABLE) {
+        len = sprintf(header, "HTTP/1.1 %d %s\r\n"
+                              "Content-Range: bytes */%zu\r\n"
+                              "Content-length: 0\r\n",
+                      HTTP_RANGE_NOT_SATISFIABLE,
+                      get_shortmsg_from_status_code(HTTP_RANGE_NOT_SATISFIABLE),
+                      (size_t)fe->size);
+        len += http_conn_header(out, header + len);
+        file_cache_release(fe);
+
+        return http_chain_copy(out->chain, header, len);
+    }
+
+    if (n == 1) {
+        len = sprintf(header, "HTTP/1.1 %d %s\r\n"
+                              "Content-type: %s\r\n"
+                              "Content-Range: bytes %zu-%zu/%zu\r\n"
+                              "Content-length: %zu\r\n"
+                              "Last-Modified: %s\r\n"
+                              "ETag: %s\r\n",
+                      HTTP_PARTIAL_CONTENT, get_shortmsg_from_status_code(HTTP_PARTIAL_CONTENT),
+                      fe->mime, (size_t)ranges[0].start, (size_t)ranges[0].end, (size_t)fe->size,
+                      (size_t)(ranges[0].end - ranges[0].start + 1), fe->last_modified, fe->etag);
+        if (fe->vary) {
+            len += sprintf(header + len, "Vary: Accept-Encoding\r\n");
+        }
+        len += http_conn_header(out, header + len);
+
+        if (http_chain_copy(out->chain, header, len) != RETURN_OK
+            || (!out->header_only
+                && http_static_body(out, fe, ranges[0].start, ranges[0].end - ranges[0].start + 1) != RETURN_OK)) {
+            ret = RETURN_ERROR;
+        }
+
+        file_cache_release(fe);
+        return ret;
+    }
+
+    sprintf(boundary, "%020lu", (unsigned long)__atomic_add_fetch(&boundary_seq, 1, __ATOMIC_RELAXED));
+
+    /* every part is "\r\n--boundary", its headers and its bytes */
+    total = sizeof("\r\n--") - 1 + strlen(boundary) + sizeof("--\r\n") - 1;
+    for (int i = 0; i < n; i++) {
+        total += snprintf(NULL, 0, "\r\n--%s\r\n"
+                                   "Content-type: %s\r\n"
+                                   "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                          boundary, fe->mime, (size_t)ranges[i].start, (size_t)ranges[i].end,
+                          (size_t)fe->size);
+        total += ranges[i].end - ranges[i].start + 1;
+    }
+
+    len = sprintf(header, "HTTP/1.1 %d %s\r\n"
+                          "Content-type: multipart/byteranges; boundary=%s\r\n"
+                          "Content-length: %zu\r\n"
+                          "Last-Modified: %s\r\n"
+                          "ETag: %s\r\n",
+                  HTTP_PARTIAL_CONTENT, get_shortmsg_from_status_code(HTTP_PARTIAL_CONTENT),
+                  boundary, total, fe->last_modified, fe->etag);
+    if (fe->vary) {
+        len += sprintf(header + len, "Vary: Accept-Encoding\r\n");
+    }
+    len += http_conn_header(out, header + len);
+
+    if (http_chain_copy(out->chain, header, len) != RETURN_OK) {
+        file_cache_release(fe);
+        return RETURN_ERROR;
     }
 
-    int i;
-    for (i = 0; mime[i].type != NULL; ++i) {
-        if (strcmp(type, mime[i].type) == 0)
-            return mime[i].value;
+    if (out->header_only) {
+        file_cache_release(fe);
+        return RETURN_OK;
     }
-    return mime[i].value;
-}
\ No newline at end of file
+
+    for (int i = 0; i < n && ret == RETURN_OK; i++) {
+        part_len = sprintf(header, "\r\n--%s\r\n"
+                                   "Content-type: %s\r\n"
+                                   "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                           boundary, fe->mime, (size_t)ranges[i].start, (size_t)ranges[i].end,
+                           (size_t)fe->size);
+
+        if (http_chain_copy(out->chain, header, part_len) != RETURN_OK
+            || http_static_body(out, fe, ranges[i].start,
+                                ranges[i].end - ranges[i].start + 1) != RETURN_OK) {
+            ret = RETURN_ERROR;
+        }
+    }
+
+    if (ret == RETURN_OK) {
+        len = sprintf(header, "\r\n--%s--\r\n", boundary);
+        ret = http_chain_copy(out->chain, header, len);
+    }
+
+    file_cache_release(fe);
+    return ret;
+}
+
+/*
+*   the response owns the reference to fe. A 200 is the status line and
+*   entity headers serialized in fe, the connection headers and the body,
+*   all gathered by one sendmsg. A client taking gzip may get the variant
+*/
+static int serve_static(file_cache_entry_t *fe, http_out_t *out) {
+    char header[MAXLINE];
+    http_range_t ranges[HTTP_RANGES_MAX];
+    file_cache_variant_t *v;
+    file_cache_entry_t *body = fe;  /* the entry the body is sent from */
+    const char *entity = fe->header;
+    size_t entity_len = fe->header_len;
+    char *data = fe->data;
+    off_t size = fe->size;
+    ssize_t n;
+
+    /* ranges are served from the identity, so a Range request validates it */
+    v = out->gzip && out->range == NULL ? http_gzip_variant(fe) : NULL;
+
+    if ((out->if_none_match || out->if_modified_since)
+        && http_not_modified(fe, v ? v->etag : fe->etag, out)) {
+        return serve_not_modified(fe, v ? v->etag : fe->etag, v || fe->vary, out);
+    }
+
+    if (out->range && fe->size > 0 && http_if_range(fe, out)) {
+        n = http_parse_range(out->range, out->range_len, fe->size, ranges, HTTP_RANGES_MAX);
+        if (n != 0) {
+            return serve_ranges(fe, out, ranges, (int)n);
+        }
+    }
+
+    if (v) {
+        entity = v->header;
+        entity_len = v->header_len;
+        size = v->size;
+        if (v->file) {
+            body = v->file;
+            data = body->data;
+        } else {
+            data = v->data;
+        }
+    }
+
+    /* every link holds its own reference */
+    file_cache_ref(fe);
+    if (http_chain_add_mem(out->chain, fe, (char *)entity, entity_len) != RETURN_OK) {
+        file_cache_release(fe);
+        return RETURN_ERROR;
+    }
+
+    n = http_conn_header(out, header);
+    if (http_chain_copy(out->chain, header, n) != RETURN_OK) {
+        LOG_ERROR("queue header error");
+        file_cache_release(fe);
+        return RETURN_ERROR;
+    }
+
+    /* HEAD: Content-length is the size of the identity or of the variant, no body follows */
+    if (size == 0 || out->header_only) {
+        file_cache_release(fe);
+        return RETURN_OK;
+    }
+
+    /* the .gz sibling outlives fe, which keeps it as its variant */
+    if (body != fe) {
+        file_cache_ref(body);
+        file_cache_release(fe);
+    }
+
+    /* a hot object or a compressed variant is sent from shared memory */
+    if (data) {
+        return http_chain_add_mem(out->chain, body, data, size);
+    }
+
+    /* sent straight from the page cache, the chain releases body */
+    return http_chain_add_file(out->chain, body, 0, size);
+}
+
+/* the status line of a 200 and the headers that only depend on the file, or its variant v */
+size_t http_entity_header(file_cache_entry_t *fe, file_cache_variant_t *v, char *buf, size_t len) {
+    return snprintf(buf, len,
+                    "HTTP/1.1 200 OK\r\n"
+                    "Content-type: %s\r\n"
+                    "%s"
+                    "Content-length: %zu\r\n"
+                    "Last-Modified: %s\r\n"
+                    "ETag: %s\r\n"
+                    "%s"
+                    "%s",
+                    fe->mime,
+                    v ? "Content-Encoding: gzip\r\n" : "",
+                    v ? v->size : (size_t)fe->size,
+                    fe->last_modified,
+                    v ? v->etag : fe->etag,
+                    v ? "" : "Accept-Ranges: bytes\r\n",
+                    v || fe->vary ? "Vary: Accept-Encoding\r\n" : "");
+}
@@ -0,0 +1,249 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <gperftools/tcmalloc.h>
+
+#include "http_gzip.h"
+#include "http.h"
+#include "ring_log.h"
+
+static int      http_gzip_on;           /* compress in memory */
+static int      http_gzip_static;       /* send the .gz next to the file */
+static size_t   http_gzip_cache;        /* byte budget of compressed variants */
+static size_t   http_gzip_used;
+
+/* MIME types worth compressing */
+static const char *http_gzip_types[] = {
+    "text/",
+    "application/javascript",
+    "application/json",
+    "application/xml",
+    "application/xhtml+xml",
+    "application/rtf",
+    "image/svg+xml",
+    NULL
+};
+
+int http_gzip_init(int on, int use_static, size_t cache)
+{
+    http_gzip_on = on;
+    http_gzip_static = use_static;
+    http_gzip_cache = cache;
+
+    LOG_INFO("gzip: %s, static %s, cache %zu bytes",
+             on ? "on" : "off", use_static ? "on" : "off", cache);
+
+    return 0;
+}
+
+static int http_gzip_type(const char *mime)
+{
+    for (int i = 0; http_gzip_types[i] != NULL; i++) {
+        if (strncmp(mime, http_gzip_types[i], strlen(http_gzip_types[i])) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* path with .gz appended, 0 if it does not fit */
+static int http_gzip_path(file_cache_entry_t *fe, char *path)
+{
+    if (fe->len + sizeof(".gz") > PATH_MAX) {
+        return 0;
+    }
+
+    memcpy(path, fe->name, fe->len);
+    memcpy(path + fe->len, ".gz", sizeof(".gz"));
+
+    return 1;
+}
+
+int http_gzip_vary(file_cache_entry_t *fe)
+{
+    char path[PATH_MAX];
+
+    if (http_gzip_on && http_gzip_type(fe->mime)) {
+        return 1;
+    }
+
+    return http_gzip_static && http_gzip_path(fe, path) && access(path, F_OK) == 0;
+}
+
+/* the .gz file next to fe, if it is not older than fe */
+static int http_gzip_sibling(file_cache_entry_t *fe, file_cache_variant_t *v)
+{
+    char path[PATH_MAX];
+    file_cache_entry_t *gz;
+
+    if (!http_gzip_path(fe, path)) {
+        return -1;
+    }
+
+    gz = file_cache_get(path);
+    if (gz == NULL) {
+        return -1;
+    }
+
+    if (gz->err != 0 || !S_ISREG(gz->mode) || gz->mtime < fe->mtime) {
+        file_cache_release(gz);
+        return -1;
+    }
+
+    /* the variant keeps the reference */
+    v->file = gz;
+    v->size = gz->size;
+    strcpy(v->etag, gz->etag);
+
+    return 0;
+}
+
+static int http_gzip_compress(file_cache_entry_t *fe, file_cache_variant_t *v)
+{
+    z_stream zs;
+    char *src = fe->data, *buf = NULL, *dst = NULL;
+    size_t bound, off;
+    ssize_t n;
+    int rc;
+
+    /* a hot object is in memory already, otherwise read it once */
+    if (src == NULL) {
+        buf = (char *)tc_malloc(fe->size);
+        if (buf == NULL) {
+            return -1;
+        }
+
+        for (off = 0; off < (size_t)fe->size; off += n) {
+            n = pread(fe->fd, buf + off, fe->size - off, off);
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            if (n <= 0) {
+                tc_free(buf);
+                return -1;
+            }
+        }
+        src = buf;
+    }
+
+    memset(&zs, 0, sizeof(zs));
+    /* 16 + window bits: a gzip wrapper instead of zlib */
+    if (deflateInit2(&zs, HTTP_GZIP_LEVEL, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        tc_free(buf);
+        return -1;
+    }
+
+    bound = deflateBound(&zs, fe->size);
+    if (__atomic_add_fetch(&http_gzip_used, bound, __ATOMIC_RELAXED) > http_gzip_cache
+        || (dst = (char *)tc_malloc(bound)) == NULL) {
+        __atomic_sub_fetch(&http_gzip_used, bound, __ATOMIC_RELAXED);
+        deflateEnd(&zs);
+        tc_free(buf);
+        return -1;
+    }
+
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = fe->size;
+    zs.next_out = (Bytef *)dst;
+    zs.avail_out = bound;
+
+    rc = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    tc_free(buf);
+
+    /* incompressible, the identity response is smaller */
+    if (rc != Z_STREAM_END || zs.total_out >= (uLong)fe->size) {
+        __atomic_sub_fetch(&http_gzip_used, bound, __ATOMIC_RELAXED);
+        tc_free(dst);
+        return -1;
+    }
+
+    __atomic_sub_fetch(&http_gzip_used, bound - zs.total_out, __ATOMIC_RELAXED);
+
+    v->data = dst;
+    v->size = zs.total_out;
+    /* the ETag of the file with -gz before the closing quote */
+    sprintf(v->etag, "%.*s-gz\"", (int)strlen(fe->etag) - 1, fe->etag);
+
+    LOG_INFO("gzip %s: %zu -> %zu bytes", fe->name, (size_t)fe->size, v->size);
+
+    return 0;
+}
+
+static file_cache_variant_t *http_gzip_build(file_cache_entry_t *fe)
+{
+    file_cache_variant_t *v;
+
+    v = (file_cache_variant_t *)tc_calloc(1, sizeof(file_cache_variant_t));
+    if (v == NULL) {
+        return NULL;
+    }
+
+    if (http_gzip_static && http_gzip_sibling(fe, v) == 0) {
+        goto header;
+    }
+
+    if (http_gzip_on && http_gzip_type(fe->mime)
+        && fe->size >= HTTP_GZIP_MIN_LENGTH && fe->size <= HTTP_GZIP_MAX_LENGTH
+        && http_gzip_compress(fe, v) == 0) {
+        goto header;
+    }
+
+    /* header_len 0 remembers there is no variant */
+    return v;
+
+header:
+
+    v->header_len = http_entity_header(fe, v, v->header, FILE_CACHE_HEADER_LEN);
+    if (v->header_len >= FILE_CACHE_HEADER_LEN) {
+        v->header_len = 0;
+    }
+
+    return v;
+}
+
+file_cache_variant_t *http_gzip_variant(file_cache_entry_t *fe)
+{
+    file_cache_variant_t *v, *expected = NULL;
+
+    if (!http_gzip_on && !http_gzip_static) {
+        return NULL;
+    }
+
+    v = __atomic_load_n(&fe->gzip, __ATOMIC_ACQUIRE);
+    if (v == NULL) {
+        v = http_gzip_build(fe);
+        if (v == NULL) {
+            return NULL;
+        }
+
+        /* built once, a worker that lost the race uses the winner's */
+        if (!__atomic_compare_exchange_n(&fe->gzip, &expected, v, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            http_gzip_free(v);
+            v = expected;
+        }
+    }
+
+    return v->header_len ? v : NULL;
+}
+
+void http_gzip_free(file_cache_variant_t *v)
+{
+    if (v->file) {
+        file_cache_release(v->file);
+    }
+
+    if (v->data) {
+        tc_free(v->data);
+        __atomic_sub_fetch(&http_gzip_used, v->size, __ATOMIC_RELAXED);
+    }
+
+    tc_free(v);
+}
@@ -0,0 +1,258 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <gperftools/tcmalloc.h>
+
+#include "http_mime.h"
+#include "ring_log.h"
+
+typedef struct http_mime_slot_s {
+    uint32_t        hash;
+    uint32_t        len;
+    char            exten[HTTP_MIME_EXTEN_LEN];     /* lower case */
+    const char     *value;                          /* NULL: free slot */
+} http_mime_slot_t;
+
+static mime_type_t mime[] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"shtml", "text/html"},
+    {"xml", "text/xml"},
+    {"xhtml", "application/xhtml+xml"},
+    {"txt", "text/plain"},
+    {"css", "text/css"},
+    {"csv", "text/csv"},
+    {"md", "text/markdown"},
+    {"js", "application/javascript"},
+    {"mjs", "application/javascript"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"wasm", "application/wasm"},
+    {"rtf", "application/rtf"},
+    {"pdf", "application/pdf"},
+    {"word", "application/msword"},
+    {"doc", "application/msword"},
+    {"xls", "application/vnd.ms-excel"},
+    {"ppt", "application/vnd.ms-powerpoint"},
+    {"png", "image/png"},
+    {"gif", "image/gif"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"svg", "image/svg+xml"},
+    {"svgz", "image/svg+xml"},
+    {"ico", "image/x-icon"},
+    {"bmp", "image/bmp"},
+    {"tif", "image/tiff"},
+    {"tiff", "image/tiff"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"au", "audio/basic"},
+    {"mp3", "audio/mpeg"},
+    {"ogg", "audio/ogg"},
+    {"wav", "audio/wav"},
+    {"mpeg", "video/mpeg"},
+    {"mpg", "video/mpeg"},
+    {"mp4", "video/mp4"},
+    {"webm", "video/webm"},
+    {"avi", "video/x-msvideo"},
+    {"gz", "application/x-gzip"},
+    {"tar", "application/x-tar"},
+    {"zip", "application/zip"},
+    {"bz2", "application/x-bzip2"},
+    {"xz", "application/x-xz"},
+    {NULL, NULL}
+};
+
+static http_mime_slot_t *http_mime_table;
+static uint32_t         http_mime_mask;
+
+/* FNV-1a of the lower case extension, written to exten */
+static uint32_t http_mime_hash(const char *p, size_t len, char *exten)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        exten[i] = tolower((unsigned char)p[i]);
+        h ^= (unsigned char)exten[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/* a later type of the same extension replaces the earlier one */
+static void http_mime_add(const char *exten, const char *value)
+{
+    http_mime_slot_t *slot;
+    char buf[HTTP_MIME_EXTEN_LEN];
+    size_t len = strlen(exten);
+    uint32_t h;
+
+    if (len == 0 || len > HTTP_MIME_EXTEN_LEN) {
+        return;
+    }
+
+    h = http_mime_hash(exten, len, buf);
+
+    for (uint32_t i = h & http_mime_mask; ; i = (i + 1) & http_mime_mask) {
+        slot = &http_mime_table[i];
+
+        if (slot->value == NULL) {
+            slot->hash = h;
+            slot->len = len;
+            memcpy(slot->exten, buf, len);
+            slot->value = value;
+            return;
+        }
+
+        if (slot->hash == h && slot->len == len && memcmp(slot->exten, buf, len) == 0) {
+            slot->value = value;
+            return;
+        }
+    }
+}
+
+/*
+*   "type exten exten ..." per line, '#' starts a comment. The nginx
+*   format ("types {", "type exten ...;", "}") is read as well. The file
+*   stays in memory, the pairs point into it
+*/
+static int http_mime_load(const char *file, mime_type_t **out, int *count)
+{
+    mime_type_t *types = NULL, *tmp;
+    char *text, *line, *tok, *type, *save_line, *save_tok;
+    int n = 0, cap = 0;
+    long size;
+    FILE *fp;
+
+    fp = fopen(file, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    text = size < 0 ? NULL : (char *)tc_malloc(size + 1);
+    if (text == NULL || fread(text, 1, size, fp) != (size_t)size) {
+        fclose(fp);
+        tc_free(text);
+        return -1;
+    }
+    text[size] = '\0';
+    fclose(fp);
+
+    for (line = strtok_r(text, "\n", &save_line); line; line = strtok_r(NULL, "\n", &save_line)) {
+        if ((tok = strchr(line, '#')) != NULL) {
+            *tok = '\0';
+        }
+
+        type = strtok_r(line, " \t\r;{}", &save_tok);
+        /* "types" of nginx, and anything else that is not a type */
+        if (type == NULL || strchr(type, '/') == NULL) {
+            continue;
+        }
+
+        while ((tok = strtok_r(NULL, " \t\r;{}", &save_tok)) != NULL) {
+            if (n == cap) {
+                cap = cap ? cap * 2 : 256;
+                tmp = (mime_type_t *)tc_realloc(types, cap * sizeof(mime_type_t));
+                if (tmp == NULL) {
+                    tc_free(types);
+                    tc_free(text);
+                    return -1;
+                }
+                types = tmp;
+            }
+
+            types[n].type = tok[0] == '.' ? tok + 1 : tok;
+            types[n].value = type;
+            n++;
+        }
+    }
+
+    *out = types;
+    *count = n;
+
+    return 0;
+}
+
+int http_mime_init(const char *file)
+{
+    mime_type_t *types = NULL;
+    int builtin, n = 0;
+    uint32_t size = 1;
+
+    if (file && http_mime_load(file, &types, &n) < 0) {
+        LOG_ERROR("mime: can not read %s", file);
+        return -1;
+    }
+
+    for (builtin = 0; mime[builtin].type != NULL; builtin++) {
+    }
+
+    /* at most half full, a miss ends at a free slot soon */
+    while (size < 2 * (uint32_t)(builtin + n)) {
+        size <<= 1;
+    }
+
+    http_mime_table = (http_mime_slot_t *)tc_calloc(size, sizeof(http_mime_slot_t));
+    if (http_mime_table == NULL) {
+        tc_free(types);
+        return -1;
+    }
+    http_mime_mask = size - 1;
+
+    for (int i = 0; i < builtin; i++) {
+        http_mime_add(mime[i].type, mime[i].value);
+    }
+
+    for (int i = 0; i < n; i++) {
+        http_mime_add(types[i].type, types[i].value);
+    }
+    tc_free(types);
+
+    LOG_INFO("mime: %d built-in extensions, %d from %s, %u slots",
+             builtin, n, file ? file : "no file", size);
+
+    return 0;
+}
+
+const char* get_file_type(const char *path)
+{
+    http_mime_slot_t *slot;
+    char buf[HTTP_MIME_EXTEN_LEN];
+    const char *end = path + strlen(path), *p;
+    size_t len;
+    uint32_t h;
+
+    /* the dot of a directory name is not an extension */
+    for (p = end; p > path && p[-1] != '.' && p[-1] != '/'; p--) {
+    }
+
+    len = end - p;
+    if (p == path || p[-1] != '.' || len == 0 || len > HTTP_MIME_EXTEN_LEN
+        || http_mime_table == NULL) {
+        return HTTP_MIME_DEFAULT;
+    }
+
+    h = http_mime_hash(p, len, buf);
+
+    for (uint32_t i = h & http_mime_mask; ; i = (i + 1) & http_mime_mask) {
+        slot = &http_mime_table[i];
+
+        if (slot->value == NULL) {
+            return HTTP_MIME_DEFAULT;
+        }
+
+        if (slot->hash == h && slot->len == len && memcmp(slot->exten, buf, len) == 0) {
+            return slot->value;
+        }
+    }
+}
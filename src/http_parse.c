@@ -1,12 +1,82 @@
-#include <gperftools/tcmalloc.h>
+/* HTTP_NO_SIMD builds the scalar http_scan, bench/parse_bench compares them */
+#if defined(HTTP_NO_SIMD)
+#define HTTP_SCAN_AVX2  0
+#define HTTP_SCAN_SSE2  0
+#elif defined(__AVX2__)
+#define HTTP_SCAN_AVX2  1
+#define HTTP_SCAN_SSE2  1
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#define HTTP_SCAN_AVX2  0
+#define HTTP_SCAN_SSE2  1
+#include <emmintrin.h>
+#else
+#define HTTP_SCAN_AVX2  0
+#define HTTP_SCAN_SSE2  0
+#endif
 
 #include "http.h"
 #include "http_parse.h"
 
+/*
+*   index of the first c0 or c1 in p[0, len), len if there is none.
+*   The state machine only reacts to a few bytes in the uri, the header key
+*   and the header value, so those runs are skipped 32 (AVX2) or 16 (SSE2)
+*   bytes at a time and the switch only sees the boundaries
+*/
+static inline size_t http_scan(const unsigned char *p, size_t len,
+                               unsigned char c0, unsigned char c1)
+{
+    size_t i = 0;
+
+#if HTTP_SCAN_AVX2
+    const __m256i v0 = _mm256_set1_epi8((char)c0);
+    const __m256i v1 = _mm256_set1_epi8((char)c1);
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(d, v0), _mm256_cmpeq_epi8(d, v1)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+#if HTTP_SCAN_SSE2
+    const __m128i w0 = _mm_set1_epi8((char)c0);
+    const __m128i w1 = _mm_set1_epi8((char)c1);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(d, w0), _mm_cmpeq_epi8(d, w1)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    /* scalar tail, or the whole run without SIMD */
+    for (; i < len; i++) {
+        if (p[i] == c0 || p[i] == c1) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/* skip to the first c0 or c1 in [p, end), end if there is none */
+static inline unsigned char *http_skip(unsigned char *p, unsigned char *end,
+                                       unsigned char c0, unsigned char c1)
+{
+    return p + http_scan(p, end - p, c0, c1);
+}
+
 
 int http_parse_request_line(http_request_t *request) {
-    unsigned char ch, *p, *m;
-    size_t i;
+    unsigned char ch, *p, *m, *end;
 
     enum {
         start = 0,
@@ -27,10 +97,21 @@ int http_parse_request_line(http_request_t *request) {
     } state;
 
     state = request->state;
+
+    /* the ring is mapped twice, the unparsed bytes are contiguous */
+    p = (unsigned char *)http_ring_at(request, request->pos);
+    end = p + (request->last - request->pos);
     
-    for (i = request->pos; i < request->last; i++)
+    for (; p < end; p++)
     {
-        p = (unsigned char *)&request->buf[i % MAX_BUF];
+        /* fast path: the uri ends at the next space */
+        if (state == after_slash_in_uri) {
+            p = http_skip(p, end, ' ', ' ');
+            if (p == end) {
+                break;
+            }
+        }
+
         ch = *p;
 
         switch (state)
@@ -255,13 +336,13 @@ int http_parse_request_line(http_request_t *request) {
         }
     }
 
-    request->pos = i;
+    request->pos = request->last;
     request->state = state;
 
     return AGAIN;
 
 done:
-    request->pos = i + 1;
+    request->pos = request->last - (end - p) + 1;
 
     if(request->request_end == NULL) {
         request->request_end = p;
@@ -273,9 +354,25 @@ done:
 } 
 
 
+/* save the current http header */
+static int http_save_header(http_request_t *request) {
+    http_header_t *hd = http_add_header(request);
+
+    if(hd == NULL) {
+        return HTTP_PARSE_INVALID_HEADER;
+    }
+
+    hd->key_start = request->cur_header_key_start;
+    hd->key_end = request->cur_header_key_end;
+    hd->value_start = request->cur_header_value_start;
+    hd->value_end = request->cur_header_value_end;
+    hd->id = request->cur_header_id;
+
+    return RETURN_OK;
+}
+
 int http_parse_request_body(http_request_t *request) {
-    unsigned char ch, *p;
-    size_t i;
+    unsigned char ch, *p, *end;
 
     enum {
         start = 0,
@@ -288,38 +385,50 @@ int http_parse_request_body(http_request_t *request) {
         crlfcr
     } state;
 
+    /* resumes where the previous read stopped */
     state = request->state;
-    if(state != 0) {
-        return -1;
-    }
 
-    http_header_t *hd;
-    for(i = request->pos; i < request->last; i++) {
-        p = (unsigned char *)&request->buf[i % MAX_BUF];
+    p = (unsigned char *)http_ring_at(request, request->pos);
+    end = p + (request->last - request->pos);
+
+    for(; p < end; p++) {
+        /* fast path: a key ends at space or colon, a value at CR or LF */
+        if(state == key) {
+            p = http_skip(p, end, ' ', ':');
+        } else if(state == value) {
+            p = http_skip(p, end, CR, LF);
+        }
+        if(p == end) {
+            break;
+        }
+
         ch = *p;
 
         switch (state)
         {
+        /* beginning of a header line, or of the empty line */
         case start:
-            if(ch == CR || ch == LF) {
+        case crlf:
+            if(ch == CR) {
+                state = crlfcr;
                 break;
             }
 
+            if(ch == LF) {
+                goto done;
+            }
+
             request->cur_header_key_start = p;
             state = key;
             break;
         
         case key:
-            if(ch == ' ') {
+            if(ch == ' ' || ch == ':') {
                 request->cur_header_key_end = p;
-                state = spaces_before_colon;
-                break;
-            }
-
-            if(ch == ':') {
-                request->cur_header_key_end = p;
-                state = spaces_after_colon;
-                break;
+                /* identify known headers while the key is hot */
+                request->cur_header_id = http_header_lookup(request->cur_header_key_start,
+                                            p - (unsigned char *)request->cur_header_key_start);
+                state = ch == ' ' ? spaces_before_colon : spaces_after_colon;
             }
             break;
         
@@ -340,16 +449,20 @@ int http_parse_request_body(http_request_t *request) {
 
             state = value;
             request->cur_header_value_start = p;
-            break;
+            /* fall through, the value may be empty */
         
         case value:
             if(ch == CR) {
                 request->cur_header_value_end = p;
                 state = cr;
+                break;
             }
 
             if(ch == LF) {
-                request->cur_header_key_end = p;
+                request->cur_header_value_end = p;
+                if(http_save_header(request) != RETURN_OK) {
+                    return HTTP_PARSE_INVALID_HEADER;
+                }
                 state = crlf;
             }
 
@@ -357,30 +470,15 @@ int http_parse_request_body(http_request_t *request) {
         
         case cr:
             if(ch == LF) {
+                if(http_save_header(request) != RETURN_OK) {
+                    return HTTP_PARSE_INVALID_HEADER;
+                }
                 state = crlf;
-                // save the current http header
-                hd = (http_header_t *)tc_malloc(sizeof(http_header_t));
-                hd->key_start = request->cur_header_key_start;
-                hd->key_end = request->cur_header_key_end;
-                hd->value_start = request->cur_header_value_start;
-                hd->value_end = request->cur_header_value_end;
-
-                list_add(&(hd->list), &(request->list));
-                
                 break;
             } else {
                 return HTTP_PARSE_INVALID_HEADER;
             }
         
-        case crlf:
-            if(ch == CR) {
-                state = crlfcr;
-            } else {
-                request->cur_header_key_start = p;
-                state = key;
-            }
-            break;
-        
         case crlfcr:
             switch(ch) {
                 case LF:
@@ -393,14 +491,429 @@ int http_parse_request_body(http_request_t *request) {
 
         }
     }
-    request->pos = i;
+    request->pos = request->last;
     request->state = state;
 
     return AGAIN;
 
 done:
-    request->pos = i + 1;
+    request->pos = request->last - (end - p) + 1;
     request->state = start;
 
     return RETURN_OK;
-}
\ No newline at end of file
+}
+
+/* value of a hex digit, -1 for any other character */
+static inline int http_hex(unsigned char ch) {
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+
+    ch |= 0x20;
+    if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+
+    return -1;
+}
+
+/* how the body is framed, from Content-Length and Transfer-Encoding */
+static int http_body_init(http_request_t *request) {
+    http_header_t *hd;
+    unsigned char *v, *e;
+    size_t len = 0;
+    int has_length = 0;
+
+    request->chunked = 0;
+    request->body_rest = 0;
+    request->body_received = 0;
+    request->body_state = 0;
+    request->body_handler = http_body_handler;
+
+    for (int i = 0; i < request->nheaders; i++) {
+        hd = http_header_at(request, i);
+        v = hd->value_start;
+        e = hd->value_end;
+
+        if (hd->id == HTTP_HEADER_TRANSFER_ENCODING) {
+            /* only chunked is decoded, and it must be the last coding */
+            while (e > v && (e[-1] == ' ' || e[-1] == '\t')) {
+                e--;
+            }
+            if (e - v < 7 || strncasecmp((char *)e - 7, "chunked", 7) != 0) {
+                return HTTP_PARSE_INVALID_BODY;
+            }
+            request->chunked = 1;
+
+        } else if (hd->id == HTTP_HEADER_CONTENT_LENGTH) {
+            if (v == e || has_length) {
+                return HTTP_PARSE_INVALID_BODY;
+            }
+
+            for (; v < e; v++) {
+                if (*v < '0' || *v > '9') {
+                    return HTTP_PARSE_INVALID_BODY;
+                }
+                len = len * 10 + (*v - '0');
+                if (len > request->max_body) {
+                    return HTTP_PARSE_BODY_TOO_LARGE;
+                }
+            }
+            has_length = 1;
+        }
+    }
+
+    /* Transfer-Encoding overrides Content-Length */
+    if (!request->chunked) {
+        request->body_rest = len;
+    }
+
+    request->body_start = request->pos;
+
+    return RETURN_OK;
+}
+
+/*
+*   hand the body in [pos, last) to the body handler. Everything up to last
+*   is consumed, even half a chunk size line, so the parser keeps its state
+*   and the next read reuses the ring from body_start
+*/
+static int http_parse_body(http_request_t *request) {
+    unsigned char ch, *p, *end;
+    size_t n;
+    int hex;
+
+    enum {
+        size_start = 0,
+        size,
+        extension,
+        size_cr,
+        data,
+        data_cr,
+        data_lf,
+        trailer,
+        trailer_line,
+        trailer_cr
+    } state;
+
+    p = (unsigned char *)http_ring_at(request, request->pos);
+    end = p + (request->last - request->pos);
+
+    if (!request->chunked) {
+        n = MIN(request->body_rest, (size_t)(end - p));
+        if (n > 0 && request->body_handler(request, (char *)p, n) != RETURN_OK) {
+            return HTTP_PARSE_INVALID_BODY;
+        }
+
+        request->body_rest -= n;
+        request->body_received += n;
+
+        if (request->body_rest == 0) {
+            request->pos += n;
+            return RETURN_OK;
+        }
+
+        goto again;
+    }
+
+    state = request->body_state;
+
+    for (; p < end; p++) {
+        /* chunk data goes to the handler in one piece per read */
+        if (state == data) {
+            n = MIN(request->body_rest, (size_t)(end - p));
+            if (request->body_handler(request, (char *)p, n) != RETURN_OK) {
+                return HTTP_PARSE_INVALID_BODY;
+            }
+
+            request->body_rest -= n;
+            request->body_received += n;
+            p += n;
+
+            if (request->body_rest > 0) {
+                break;
+            }
+
+            state = data_cr;
+            if (p == end) {
+                break;
+            }
+        }
+
+        ch = *p;
+
+        switch (state)
+        {
+        case size_start:
+            hex = http_hex(ch);
+            if (hex < 0) {
+                return HTTP_PARSE_INVALID_BODY;
+            }
+
+            request->body_rest = hex;
+            state = size;
+            break;
+
+        case size:
+            hex = http_hex(ch);
+            if (hex >= 0) {
+                if (request->body_rest > (request->max_body - request->body_received) >> 4) {
+                    return HTTP_PARSE_BODY_TOO_LARGE;
+                }
+                request->body_rest = request->body_rest * 16 + hex;
+                break;
+            }
+
+            if (ch == ';' || ch == ' ' || ch == '\t') {
+                state = extension;
+                break;
+            }
+
+            if (ch == CR) {
+                state = size_cr;
+                break;
+            }
+
+            if (ch == LF) {
+                goto size_done;
+            }
+
+            return HTTP_PARSE_INVALID_BODY;
+
+        /* chunk extensions are ignored */
+        case extension:
+            if (ch == LF) {
+                goto size_done;
+            }
+            break;
+
+        case size_cr:
+            if (ch == LF) {
+                goto size_done;
+            }
+            return HTTP_PARSE_INVALID_BODY;
+
+        case data_cr:
+            if (ch == CR) {
+                state = data_lf;
+                break;
+            }
+
+            if (ch == LF) {
+                state = size_start;
+                break;
+            }
+
+            return HTTP_PARSE_INVALID_BODY;
+
+        case data_lf:
+            if (ch == LF) {
+                state = size_start;
+                break;
+            }
+            return HTTP_PARSE_INVALID_BODY;
+
+        /* trailer fields after the last chunk are skipped */
+        case trailer:
+            if (ch == CR) {
+                state = trailer_cr;
+                break;
+            }
+
+            if (ch == LF) {
+                goto done;
+            }
+
+            state = trailer_line;
+            break;
+
+        case trailer_line:
+            if (ch == LF) {
+                state = trailer;
+            }
+            break;
+
+        case trailer_cr:
+            if (ch == LF) {
+                goto done;
+            }
+            return HTTP_PARSE_INVALID_BODY;
+
+        case data:
+            break;
+        }
+
+        continue;
+
+    size_done:
+        if (request->body_rest > request->max_body - request->body_received) {
+            return HTTP_PARSE_BODY_TOO_LARGE;
+        }
+
+        /* the last chunk has size 0 */
+        state = request->body_rest > 0 ? data : trailer;
+    }
+
+    request->body_state = state;
+
+again:
+    /* nothing left to parse, the next read overwrites the dead bytes */
+    request->pos = request->last = request->body_start;
+
+    return AGAIN;
+
+done:
+    request->pos = request->last - (end - p) + 1;
+
+    return RETURN_OK;
+}
+
+/*
+*   parse the request line and then the headers, across as many reads as
+*   needed. RETURN_OK once the whole request is in the buffer
+*/
+int http_parse_request(http_request_t *request) {
+    int ret;
+
+    if(request->parse_phase == HTTP_PARSE_LINE) {
+        ret = http_parse_request_line(request);
+        if(ret != RETURN_OK) {
+            return ret;
+        }
+        request->parse_phase = HTTP_PARSE_HEADERS;
+    }
+
+    if(request->parse_phase == HTTP_PARSE_HEADERS) {
+        ret = http_parse_request_body(request);
+        if(ret != RETURN_OK) {
+            return ret;
+        }
+
+        ret = http_body_init(request);
+        if(ret != RETURN_OK) {
+            goto body_error;
+        }
+        request->parse_phase = HTTP_PARSE_BODY;
+    }
+
+    if(request->parse_phase == HTTP_PARSE_BODY) {
+        if(request->chunked || request->body_rest > 0) {
+            ret = http_parse_body(request);
+            if(ret != RETURN_OK) {
+                goto body_error;
+            }
+        }
+        request->parse_phase = HTTP_PARSE_DONE;
+    }
+
+    return RETURN_OK;
+
+body_error:
+    /* answered with 413, the connection is closed after it */
+    if(ret == HTTP_PARSE_BODY_TOO_LARGE) {
+        request->err_status = HTTP_REQUEST_ENTITY_TOO_LARGE;
+        request->parse_phase = HTTP_PARSE_DONE;
+        return RETURN_OK;
+    }
+
+    return ret;
+}
+
+/*
+*   "bytes=a-b, a-, -n" against a file of size bytes. Returns the number of
+*   ranges, 0 if the header is ignored and the whole file is sent (bad
+*   syntax, another unit, more than max ranges), or
+*   HTTP_PARSE_RANGE_NOT_SATISFIABLE if no range overlaps the file
+*/
+int http_parse_range(const char *p, size_t len, off_t size, http_range_t *ranges, int max)
+{
+    const char *end = p + len;
+    off_t start, last;
+    int n = 0;
+
+    if (len < 6 || strncasecmp(p, "bytes=", 6) != 0) {
+        return 0;
+    }
+    p += 6;
+
+    for ( ;; ) {
+        start = -1;
+        last = -1;
+
+        while (p < end && *p == ' ') {
+            p++;
+        }
+
+        if (p < end && *p >= '0' && *p <= '9') {
+            for (start = 0; p < end && *p >= '0' && *p <= '9'; p++) {
+                if (start > (INT64_MAX - 9) / 10) {
+                    return 0;
+                }
+                start = start * 10 + (*p - '0');
+            }
+        }
+
+        while (p < end && *p == ' ') {
+            p++;
+        }
+
+        if (p == end || *p++ != '-') {
+            return 0;
+        }
+
+        while (p < end && *p == ' ') {
+            p++;
+        }
+
+        if (p < end && *p >= '0' && *p <= '9') {
+            for (last = 0; p < end && *p >= '0' && *p <= '9'; p++) {
+                if (last > (INT64_MAX - 9) / 10) {
+                    return 0;
+                }
+                last = last * 10 + (*p - '0');
+            }
+        }
+
+        while (p < end && *p == ' ') {
+            p++;
+        }
+
+        if (p < end && *p != ',') {
+            return 0;
+        }
+
+        if (start == -1) {
+            /* suffix: the last bytes of the file */
+            if (last == -1) {
+                return 0;
+            }
+            if (last > 0) {
+                start = last < size ? size - last : 0;
+                last = size - 1;
+            }
+
+        } else if (last != -1 && last < start) {
+            return 0;
+
+        } else if (last == -1 || last >= size) {
+            last = size - 1;
+        }
+
+        /* a range past the end of the file is dropped */
+        if (start != -1 && start < size) {
+            if (n == max) {
+                return 0;
+            }
+            ranges[n].start = start;
+            ranges[n].end = last;
+            n++;
+        }
+
+        if (p == end) {
+            break;
+        }
+        p++;
+    }
+
+    return n ? n : HTTP_PARSE_RANGE_NOT_SATISFIABLE;
+}
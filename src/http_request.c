@@ -1,44 +1,186 @@
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <gperftools/tcmalloc.h>
 
 #include "http.h"
 #include "http_request.h"
+#include "timer.h"
 
 static int http_process_ignore(http_request_t *r, http_out_t *out, char *data, int len);
 static int http_process_connection(http_request_t *r, http_out_t *out, char *data, int len);
 static int http_process_if_modified_since(http_request_t *r, http_out_t *out, char *data, int len);
+static int http_process_if_none_match(http_request_t *r, http_out_t *out, char *data, int len);
+static int http_process_accept_encoding(http_request_t *r, http_out_t *out, char *data, int len);
+static int http_process_range(http_request_t *r, http_out_t *out, char *data, int len);
+static int http_process_if_range(http_request_t *r, http_out_t *out, char *data, int len);
 
 http_header_handle_t http_headers_in[] = {
-    {"Host", http_process_ignore},
-    {"Connection", http_process_connection},
-    {"If-Modified-Since", http_process_if_modified_since},
-    {"", http_process_ignore}
+    {http_string("Host"), http_process_ignore},
+    {http_string("Connection"), http_process_connection},
+    {http_string("If-Modified-Since"), http_process_if_modified_since},
+    {http_string("If-None-Match"), http_process_if_none_match},
+    {http_string("Range"), http_process_range},
+    {http_string("If-Range"), http_process_if_range},
+    {http_string("Accept-Encoding"), http_process_accept_encoding},
+    /* framing, read by the parser */
+    {http_string("Content-Length"), http_process_ignore},
+    {http_string("Transfer-Encoding"), http_process_ignore}
 };
 
+/* hash slot -> index in http_headers_in, generated */
+static const signed char http_header_hash_index[HTTP_HEADER_HASH_SIZE] = {
+    -1,  6, -1, -1,  5, -1,  8, -1,  0,  7,  4, -1, -1,  2,  3,  1
+};
+
+static int http_discard_body(http_request_t *r, const char *data, size_t len) {
+    (void) r;
+    (void) data;
+    (void) len;
+
+    return RETURN_OK;
+}
+
+http_body_handler_pt http_body_handler = http_discard_body;
+
 int init_request_t(http_request_t *r, int fd, int epfd, conf_t *cf) {
     r->fd = fd;
     r->epfd = epfd;
+    r->buf = NULL;
     r->pos = r->last = 0;
+    r->begin = 0;
+    r->parse_phase = HTTP_PARSE_LINE;
+    r->request_end = NULL;
     r->state = 0;
     r->root = cf->root;
-    INIT_LIST_HEAD(&(r->list));
+    r->timerset = 0;
+    r->timer_shard = NULL;
+    r->timer_busy = 0;
+    r->conn_state = HTTP_CONN_READ;
+    r->nheaders = 0;
+    r->spill = NULL;
+    r->spill_size = 0;
+    r->max_body = cf->max_body > 0 ? (size_t)cf->max_body : HTTP_MAX_BODY_DEFAULT;
+    r->err_status = 0;
+    r->chain = NULL;
+    r->keep_alive = 1;
+    memset(&r->uring, 0, sizeof(r->uring));
+    r->uring.res = -EAGAIN;
+
+    return RETURN_OK;
+}
+
+/* the response is queued, get ready to parse the next request of the connection */
+int reset_request_t(http_request_t *r) {
+    r->begin = r->pos;
+    r->parse_phase = HTTP_PARSE_LINE;
+    r->state = 0;
+    r->request_end = NULL;
+    r->nheaders = 0;
+    r->err_status = 0;
 
     return RETURN_OK;
 }
 
 int free_request_t(http_request_t *r) {
-    (void) r;
+    if (r->buf) {
+        http_ring_free(r->buf);
+    }
     tc_free(r);
 
     return RETURN_OK;
 }
 
+/* rings of closed connections, linked through their first bytes */
+static char *http_ring_cache;
+static int http_ring_ncache;
+static pthread_mutex_t http_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+char *http_ring_alloc(void) {
+    char *buf;
+    int fd;
+
+    pthread_mutex_lock(&http_ring_lock);
+    buf = http_ring_cache;
+    if (buf) {
+        http_ring_cache = *(char **)buf;
+        http_ring_ncache--;
+    }
+    pthread_mutex_unlock(&http_ring_lock);
+
+    if (buf) {
+        return buf;
+    }
+
+    if (MAX_BUF % getpagesize() != 0) {
+        LOG_ERROR("MAX_BUF is not a multiple of the page size");
+        return NULL;
+    }
+
+    fd = memfd_create("http_ring", MFD_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERROR("memfd_create error");
+        return NULL;
+    }
+
+    if (ftruncate(fd, MAX_BUF) < 0) {
+        LOG_ERROR("ftruncate ring error");
+        close(fd);
+        return NULL;
+    }
+
+    /* reserve both halves, then map the same pages over each of them */
+    buf = mmap(NULL, 2 * MAX_BUF, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        LOG_ERROR("mmap ring error");
+        close(fd);
+        return NULL;
+    }
+
+    if (mmap(buf, MAX_BUF, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap(buf + MAX_BUF, MAX_BUF, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        LOG_ERROR("mmap ring error");
+        munmap(buf, 2 * MAX_BUF);
+        close(fd);
+        return NULL;
+    }
+
+    /* the mappings keep the pages */
+    close(fd);
+
+    return buf;
+}
+
+void http_ring_free(char *buf) {
+    pthread_mutex_lock(&http_ring_lock);
+    if (http_ring_ncache < HTTP_RING_CACHE) {
+        *(char **)buf = http_ring_cache;
+        http_ring_cache = buf;
+        http_ring_ncache++;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&http_ring_lock);
+
+    if (buf) {
+        munmap(buf, 2 * MAX_BUF);
+    }
+}
+
 int init_out_t(http_out_t *o, int fd) {
     o->fd = fd;
     o->keep_alive = 0;
-    o->modified = 1;
+    o->header_only = 0;
+    o->if_modified_since = NULL;
+    o->if_none_match = NULL;
+    o->gzip = 0;
+    o->range = NULL;
+    o->if_range = NULL;
     o->status = 0;
+    o->chain = NULL;
 
     return RETURN_OK;
 }
@@ -49,9 +191,484 @@ int free_out_t(http_out_t *o) {
     return RETURN_OK;
 }
 
+void http_chain_init(http_chain_t *c, int fd) {
+    c->fd = fd;
+    c->niov = 0;
+    c->used = 0;
+    c->splice = 0;
+    c->pipe[0] = c->pipe[1] = -1;
+    c->piped = 0;
+    c->pipe_size = 0;
+    c->nops = 0;
+}
+
+/* room for one more response, otherwise flush the chain first */
+int http_chain_room(http_chain_t *c) {
+    return c->niov + HTTP_CHAIN_RESERVE_IOV <= HTTP_CHAIN_IOV && c->used + HTTP_CHAIN_RESERVE <= HTTP_CHAIN_BUF;
+}
+
+/* copy data to the chain buffer, it is sent right after the previous chunk */
+int http_chain_copy(http_chain_t *c, const char *data, size_t len) {
+    char *dst;
+    struct iovec *last;
+
+    if (c->used + len > HTTP_CHAIN_BUF || c->niov == HTTP_CHAIN_IOV) {
+        LOG_ERROR("response chain is full");
+        return RETURN_ERROR;
+    }
+
+    dst = c->buf + c->used;
+    memcpy(dst, data, len);
+    c->used += len;
+
+    /* back to back headers, e.g. a run of 304s, share one iovec */
+    if (c->niov > 0 && c->files[c->niov - 1] == NULL) {
+        last = &c->iov[c->niov - 1];
+        if ((char *)last->iov_base + last->iov_len == dst) {
+            last->iov_len += len;
+            return RETURN_OK;
+        }
+    }
+
+    c->iov[c->niov].iov_base = dst;
+    c->iov[c->niov].iov_len = len;
+    c->files[c->niov] = NULL;
+    c->niov++;
+
+    return RETURN_OK;
+}
+
+/*
+*   queue len bytes of the file from offset. The chain takes the reference
+*   to fe and releases it once they are sent
+*/
+int http_chain_add_file(http_chain_t *c, file_cache_entry_t *fe, off_t offset, size_t len) {
+    if (c->niov == HTTP_CHAIN_IOV) {
+        LOG_ERROR("response chain is full");
+        file_cache_release(fe);
+        return RETURN_ERROR;
+    }
+
+    c->iov[c->niov].iov_base = NULL;
+    c->iov[c->niov].iov_len = len;
+    c->files[c->niov] = fe;
+    c->offsets[c->niov] = offset;
+    c->niov++;
+
+    return RETURN_OK;
+}
+
+/* queue len bytes of immutable memory owned by fe, the chain takes the reference */
+int http_chain_add_mem(http_chain_t *c, file_cache_entry_t *fe, char *data, size_t len) {
+    if (c->niov == HTTP_CHAIN_IOV) {
+        LOG_ERROR("response chain is full");
+        file_cache_release(fe);
+        return RETURN_ERROR;
+    }
+
+    c->iov[c->niov].iov_base = data;
+    c->iov[c->niov].iov_len = len;
+    c->files[c->niov] = fe;
+    c->niov++;
+
+    return RETURN_OK;
+}
+
+/* send the links [i, j) of memory, corked when a file follows */
+static ssize_t http_chain_send_mem(http_chain_t *c, int i, int j) {
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &c->iov[i];
+    msg.msg_iovlen = j - i;
+
+    return sendmsg(c->fd, &msg, j < c->niov ? MSG_MORE : 0);
+}
+
+/* send a chunk of the file of link i, the offset is advanced past what was read */
+static ssize_t http_chain_send_file(http_chain_t *c, int i) {
+    size_t len = MIN(c->iov[i].iov_len, HTTP_SENDFILE_CHUNK);
+    ssize_t n;
+
+    if (!c->splice) {
+        n = sendfile(c->fd, c->files[i]->fd, &c->offsets[i], len);
+        if (n >= 0 || (errno != EINVAL && errno != ENOSYS)) {
+            return n;
+        }
+
+        LOG_INFO("sendfile not supported, fall back to splice");
+        c->splice = 1;
+    }
+
+    if (c->pipe[0] < 0 && pipe2(c->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return -1;
+    }
+
+    /* file -> pipe -> socket, the pipe may still hold a chunk from the last call */
+    if (c->piped == 0) {
+        n = splice(c->files[i]->fd, (loff_t *)&c->offsets[i], c->pipe[1], NULL, len,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n <= 0) {
+            return n;
+        }
+        c->piped = n;
+    }
+
+    n = splice(c->pipe[0], NULL, c->fd, NULL, c->piped,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+    if (n > 0) {
+        c->piped -= n;
+    }
+
+    return n;
+}
+
+/* release the files and close the pipe, the chain is empty again */
+static void http_chain_reset(http_chain_t *c) {
+    for (int i = 0; i < c->niov; i++) {
+        if (c->files[i] != NULL) {
+            file_cache_release(c->files[i]);
+        }
+    }
+
+    if (c->pipe[0] >= 0) {
+        close(c->pipe[0]);
+        close(c->pipe[1]);
+        c->pipe[0] = c->pipe[1] = -1;
+    }
+
+    c->niov = 0;
+    c->used = 0;
+    c->piped = 0;
+}
+
+void http_chain_free(http_chain_t *c) {
+    http_chain_reset(c);
+    tc_free(c);
+}
+
+/*
+*   send as much of the chain as the socket takes. AGAIN when it is full:
+*   the links remember what is sent, call again on EPOLLOUT
+*/
+int http_chain_flush(http_chain_t *c) {
+    struct iovec *iov;
+    int i = 0, j;
+    int ret = RETURN_OK;
+    ssize_t n;
+
+    /* links sent by an earlier call are empty */
+    while (i < c->niov && c->iov[i].iov_len == 0 && c->files[i] == NULL) {
+        i++;
+    }
+
+    while (i < c->niov) {
+        if (http_chain_is_file(c, i)) {
+            j = i + 1;
+            n = http_chain_send_file(c, i);
+        } else {
+            for (j = i; j < c->niov && !http_chain_is_file(c, j); j++) {
+                /* a run of memory links */
+            }
+            n = http_chain_send_mem(c, i, j);
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                return AGAIN;
+            }
+
+            ret = RETURN_ERROR;
+            break;
+        }
+
+        if (http_chain_is_file(c, i)) {
+            /* the file is shorter than its Content-Length */
+            if (n == 0) {
+                LOG_ERROR("file truncated while sending");
+                ret = RETURN_ERROR;
+                break;
+            }
+
+            c->iov[i].iov_len -= n;
+            if (c->iov[i].iov_len == 0 && c->piped == 0) {
+                file_cache_release(c->files[i]);
+                c->files[i] = NULL;
+                i++;
+            }
+            continue;
+        }
+
+        /* skip what was written, a partial iovec is advanced in place */
+        for (; i < j && (size_t)n >= c->iov[i].iov_len; i++) {
+            n -= c->iov[i].iov_len;
+            c->iov[i].iov_len = 0;
+            if (c->files[i] != NULL) {
+                file_cache_release(c->files[i]);
+                c->files[i] = NULL;
+            }
+        }
+
+        if (i < j) {
+            iov = &c->iov[i];
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    http_chain_reset(c);
+
+    return ret;
+}
+
+/* first link not sent yet, niov when the chain is sent */
+static int http_chain_next(http_chain_t *c) {
+    int i = 0;
+
+    while (i < c->niov && c->iov[i].iov_len == 0 && c->files[i] == NULL) {
+        i++;
+    }
+
+    return i;
+}
+
+static http_chain_op_t *http_chain_op(http_chain_t *c, int type, int link, off_t offset, size_t len) {
+    http_chain_op_t *op = &c->ops[c->nops++];
+
+    op->type = type;
+    op->link = link;
+    op->end = link + 1;
+    op->offset = offset;
+    op->len = len;
+    op->res = 0;
+
+    return op;
+}
+
+/*
+*   queue what is left of the chain on the ring as one run of linked
+*   requests, see HTTP_CHAIN_OPS. Returns their number, 0 once all is sent
+*/
+int http_chain_submit(http_chain_t *c, int epfd, uring_handler_pt handler, void *data) {
+    http_chain_op_t *op;
+    off_t offset;
+    size_t left, len, page = getpagesize();
+    int i, j, k, link, more, ret;
+
+    i = http_chain_next(c);
+    if (i == c->niov) {
+        http_chain_reset(c);
+        return 0;
+    }
+
+    /* the pipe blocks: the kernel waits in it, not the reactor */
+    if (c->pipe[0] < 0) {
+        for (j = i; j < c->niov && !http_chain_is_file(c, j); j++) {
+            /* only memory */
+        }
+
+        if (j < c->niov) {
+            if (pipe2(c->pipe, O_CLOEXEC) < 0) {
+                return -1;
+            }
+
+            ret = fcntl(c->pipe[1], F_SETPIPE_SZ, HTTP_SENDFILE_CHUNK);
+            c->pipe_size = ret > 0 ? (size_t)ret : (size_t)fcntl(c->pipe[1], F_GETPIPE_SZ);
+        }
+    }
+
+    c->nops = 0;
+
+    while (i < c->niov && c->nops < HTTP_CHAIN_OPS) {
+        if (!http_chain_is_file(c, i)) {
+            len = 0;
+            for (j = i; j < c->niov && !http_chain_is_file(c, j); j++) {
+                len += c->iov[j].iov_len;
+            }
+
+            op = http_chain_op(c, HTTP_CHAIN_OP_SEND, i, 0, len);
+            op->end = j;
+            memset(&op->msg, 0, sizeof(op->msg));
+            op->msg.msg_iov = &c->iov[i];
+            op->msg.msg_iovlen = j - i;
+            i = j;
+            continue;
+        }
+
+        /* an empty file has nothing to splice */
+        if (c->iov[i].iov_len == 0) {
+            file_cache_release(c->files[i]);
+            c->files[i] = NULL;
+            i++;
+            continue;
+        }
+
+        /* what the pipe still holds goes first */
+        if (c->piped) {
+            http_chain_op(c, HTTP_CHAIN_OP_PIPE, i, 0, c->piped);
+        }
+
+        offset = c->offsets[i];
+        left = c->iov[i].iov_len - c->piped;
+
+        while (left && c->nops + 2 <= HTTP_CHAIN_OPS) {
+            /* the pipe holds pages, an unaligned offset takes one more */
+            len = MIN(left, c->pipe_size - (offset & (page - 1)));
+            http_chain_op(c, HTTP_CHAIN_OP_FILE, i, offset, len);
+            http_chain_op(c, HTTP_CHAIN_OP_PIPE, i, 0, len);
+            offset += len;
+            left -= len;
+        }
+
+        if (left) {
+            break;
+        }
+        i++;
+    }
+
+    /* only empty files were left */
+    if (c->nops == 0) {
+        http_chain_reset(c);
+        return 0;
+    }
+
+    if (uring_reserve(epfd, c->nops) < 0) {
+        c->nops = 0;
+        return -1;
+    }
+
+    for (k = 0; k < c->nops; k++) {
+        op = &c->ops[k];
+        op->io.handler = handler;
+        op->io.data = data;
+        link = k < c->nops - 1;
+        /* corked while more of the chain follows */
+        more = link || op->end < c->niov;
+
+        if (op->type == HTTP_CHAIN_OP_SEND) {
+            ret = uring_sendmsg(epfd, c->fd, &op->msg, MSG_WAITALL | (more ? MSG_MORE : 0), link, &op->io);
+        } else if (op->type == HTTP_CHAIN_OP_FILE) {
+            ret = uring_splice(epfd, c->files[op->link]->fd, op->offset, c->pipe[1], op->len,
+                               SPLICE_F_MOVE, link, &op->io);
+        } else {
+            ret = uring_splice(epfd, c->pipe[0], -1, c->fd, op->len,
+                               SPLICE_F_MOVE | (more ? SPLICE_F_MORE : 0), link, &op->io);
+        }
+
+        /* the room is reserved, only a lost ring fails here */
+        if (ret < 0) {
+            c->nops = k;
+            return k ? k : -1;
+        }
+    }
+
+    return c->nops;
+}
+
+/*
+*   account the completed run in order, a short or failed request cancelled
+*   the ones after it. RETURN_OK once the chain is sent, AGAIN when the rest
+*   has to be submitted
+*/
+int http_chain_complete(http_chain_t *c) {
+    http_chain_op_t *op;
+    struct iovec *iov;
+    size_t n;
+    int i, k;
+
+    for (k = 0; k < c->nops; k++) {
+        op = &c->ops[k];
+
+        if (op->res < 0) {
+            if (k > 0 && op->res == -ECANCELED) {
+                break;
+            }
+            if (op->res == -EINTR || op->res == -EAGAIN) {
+                break;
+            }
+            errno = -op->res;
+            return RETURN_ERROR;
+        }
+
+        if (op->res == 0 && op->len > 0) {
+            if (op->type == HTTP_CHAIN_OP_FILE) {
+                LOG_ERROR("file truncated while sending");
+            }
+            errno = EPIPE;
+            return RETURN_ERROR;
+        }
+
+        n = op->res;
+        i = op->link;
+
+        if (op->type == HTTP_CHAIN_OP_FILE) {
+            c->offsets[i] += n;
+            c->piped += n;
+        } else if (op->type == HTTP_CHAIN_OP_PIPE) {
+            c->piped -= n;
+            c->iov[i].iov_len -= n;
+            if (c->iov[i].iov_len == 0 && c->piped == 0) {
+                file_cache_release(c->files[i]);
+                c->files[i] = NULL;
+            }
+        } else {
+            for (; i < op->end && n >= c->iov[i].iov_len; i++) {
+                n -= c->iov[i].iov_len;
+                c->iov[i].iov_len = 0;
+                if (c->files[i] != NULL) {
+                    file_cache_release(c->files[i]);
+                    c->files[i] = NULL;
+                }
+            }
+
+            if (i < op->end) {
+                iov = &c->iov[i];
+                iov->iov_base = (char *)iov->iov_base + n;
+                iov->iov_len -= n;
+            }
+        }
+
+        if ((size_t)op->res < op->len) {
+            break;
+        }
+    }
+
+    c->nops = 0;
+
+    if (http_chain_next(c) < c->niov) {
+        return AGAIN;
+    }
+
+    http_chain_reset(c);
+
+    return RETURN_OK;
+}
+
 int http_close_conn(http_request_t *r) {
+    /* the ring still uses the socket and the chain: make them fail, the last completion closes */
+    if (r->uring.inflight) {
+        if (!r->uring.closing) {
+            r->uring.closing = 1;
+            shutdown(r->fd, SHUT_RDWR);
+        }
+        return RETURN_OK;
+    }
+
+    if (r->chain) {
+        http_chain_free(r->chain);
+        r->chain = NULL;
+    }
     close(r->fd);
-    tc_free(r);
+    if (r->spill) {
+        tc_free(r->spill);
+        r->spill = NULL;
+    }
+    /* the timer may still be linked, the owner of the shard frees r */
+    event_free_timer(r);
 
     return RETURN_OK;
 }
@@ -74,23 +691,87 @@ static int http_process_connection(http_request_t *r, http_out_t *out, char *dat
     return RETURN_OK;
 }
 
+/* compared with the cached Last-Modified string first, parsed only if it differs */
 static int http_process_if_modified_since(http_request_t *r, http_out_t *out, char *data, int len) {
     (void) r;
-    (void) len;
 
-    struct tm tm;
-    if (strptime(data, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) {
-        return RETURN_OK;
-    }
-    time_t client_time = mktime(&tm);
+    out->if_modified_since = data;
+    out->if_modified_since_len = len;
+
+    return RETURN_OK;
+}
+
+static int http_process_if_none_match(http_request_t *r, http_out_t *out, char *data, int len) {
+    (void) r;
+
+    out->if_none_match = data;
+    out->if_none_match_len = len;
+
+    return RETURN_OK;
+}
+
+/* kept for serve_static, which knows the size of the file */
+static int http_process_range(http_request_t *r, http_out_t *out, char *data, int len) {
+    (void) r;
+
+    out->range = data;
+    out->range_len = len;
+
+    return RETURN_OK;
+}
 
-    double time_diff = difftime(out->mtime, client_time);
-    if (fabs(time_diff) < 1e-6) {
-        /* Not modified */
-        out->modified = 0;
-        out->status = HTTP_NOT_MODIFIED;
+static int http_process_if_range(http_request_t *r, http_out_t *out, char *data, int len) {
+    (void) r;
+
+    out->if_range = data;
+    out->if_range_len = len;
+
+    return RETURN_OK;
+}
+
+/* "gzip", "x-gzip", or "*" without gzip, with a q value that is not 0 */
+static int http_process_accept_encoding(http_request_t *r, http_out_t *out, char *data, int len) {
+    (void) r;
+
+    char *p = data, *end = data + len, *token;
+    int token_len, zero, gzip = -1, star = 0;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+
+        token = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        token_len = p - token;
+
+        /* ";q=0", ";q=0.0" ... refuse the coding */
+        zero = 0;
+        while (p < end && *p != ',') {
+            if (*p == '=' && p > token + 1 && (p[-1] | 0x20) == 'q') {
+                zero = 1;
+                for (p++; p < end && *p != ',' && *p != ' ' && *p != ';'; p++) {
+                    if (*p != '0' && *p != '.') {
+                        zero = 0;
+                    }
+                }
+                continue;
+            }
+            p++;
+        }
+
+        if ((token_len == 4 && strncasecmp(token, "gzip", 4) == 0)
+            || (token_len == 6 && strncasecmp(token, "x-gzip", 6) == 0)) {
+            gzip = !zero;
+        } else if (token_len == 1 && *token == '*') {
+            star = !zero;
+        }
     }
-    
+
+    out->gzip = gzip == -1 ? star : gzip;
+
     return RETURN_OK;
 }
 
@@ -100,6 +781,10 @@ const char *get_shortmsg_from_status_code(int status_code) {
         return "OK";
     }
 
+    if (status_code == HTTP_PARTIAL_CONTENT) {
+        return "Partial Content";
+    }
+
     if (status_code == HTTP_NOT_MODIFIED) {
         return "Not Modified";
     }
@@ -108,33 +793,81 @@ const char *get_shortmsg_from_status_code(int status_code) {
         return "Not Found";
     }
 
+    if (status_code == HTTP_REQUEST_ENTITY_TOO_LARGE) {
+        return "Request Entity Too Large";
+    }
+
+    if (status_code == HTTP_RANGE_NOT_SATISFIABLE) {
+        return "Requested Range Not Satisfiable";
+    }
+
     return "Unknown";
 }
 
 
+/* slot for the next header, NULL if there are more than HTTP_HEADERS_MAX */
+http_header_t *http_add_header(http_request_t *r) {
+    int idx, size;
+    http_header_t *spill;
+
+    if (r->nheaders < HTTP_HEADERS_INLINE) {
+        return &r->headers[r->nheaders++];
+    }
+
+    idx = r->nheaders - HTTP_HEADERS_INLINE;
+    if (idx >= r->spill_size) {
+        if (r->nheaders >= HTTP_HEADERS_MAX) {
+            return NULL;
+        }
+
+        size = r->spill_size ? r->spill_size * 2 : HTTP_HEADERS_INLINE;
+        size = MIN(size, HTTP_HEADERS_MAX - HTTP_HEADERS_INLINE);
+
+        spill = (http_header_t *)tc_realloc(r->spill, sizeof(http_header_t) * size);
+        if (spill == NULL) {
+            return NULL;
+        }
+
+        r->spill = spill;
+        r->spill_size = size;
+    }
+
+    r->nheaders++;
+    return &r->spill[idx];
+}
+
+/* index of a known header in http_headers_in, -1 for the others */
+int http_header_lookup(const char *name, int len) {
+    int idx;
+
+    if (len <= 0) {
+        return -1;
+    }
+
+    idx = http_header_hash_index[http_header_hash(len, name[0], name[len - 1])];
+    if (idx < 0 || http_headers_in[idx].len != len
+        || strncasecmp(name, http_headers_in[idx].name, len) != 0) {
+        return -1;
+    }
+
+    return idx;
+}
+
 void http_handle_header(http_request_t *request, http_out_t *out) {
-    list_head *pos;
     http_header_t *hd;
-    http_header_handle_t *header_in;
     int len;
 
-    list_for_each(pos, &(request->list)) {
-        hd = list_entry(pos, http_header_t, list);
-        
-        /* handle */
-        for(header_in = http_headers_in; 
-            strlen(header_in->name) > 0;
-            header_in++) {
-            if(strncmp(hd->key_start, header_in->name, hd->key_end - hd->key_start) == 0) {
-
-                len = hd->value_end - hd->value_start;
-                header_in->handler(request, out, hd->value_start, len);
-                break;
-            }
+    for (int i = 0; i < request->nheaders; i++) {
+        hd = http_header_at(request, i);
+        if (hd->id < 0) {
+            continue;
         }
 
-        /* delete it from the original list */
-        list_del(pos);
-        tc_free(hd);
+        /* handle */
+        len = hd->value_end - hd->value_start;
+        http_headers_in[hd->id].handler(request, out, hd->value_start, len);
     }
+
+    /* the slots are reused by the next request of the connection */
+    request->nheaders = 0;
 }
\ No newline at end of file
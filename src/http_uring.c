@@ -0,0 +1,178 @@
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+
+#include "http.h"
+#include "http_request.h"
+#include "http_uring.h"
+#include "timer.h"
+#include "uring.h"
+#include "ring_log.h"
+
+/*
+*   A connection with requests on the ring is not closed under them:
+*   http_close_conn shuts the socket down so they fail fast, and the last
+*   completion closes it. Only then are the chain, its pipe and the file
+*   references free, and the fd number can not be reused by an accept while
+*   a linked splice still has to pick it up.
+*/
+
+static void http_uring_accept_handler(uring_io_t *io, int res, uint32_t flags);
+static void http_uring_recv_handler(uring_io_t *io, int res, uint32_t flags);
+static void http_uring_send_handler(uring_io_t *io, int res, uint32_t flags);
+
+int http_uring_listen(http_request_t *listen_request) {
+    if (uring_io_init(listen_request->epfd) < 0) {
+        return -1;
+    }
+
+    listen_request->uring.on = 1;
+    listen_request->uring.io.handler = http_uring_accept_handler;
+    listen_request->uring.io.data = listen_request;
+
+    return uring_accept(listen_request->epfd, listen_request->fd, &listen_request->uring.io);
+}
+
+static void http_uring_accept_handler(uring_io_t *io, int res, uint32_t flags) {
+    http_request_t *listen_request = (http_request_t *)io->data;
+    http_request_t *request;
+
+    if (res < 0) {
+        LOG_ERROR("accept error: %s", strerror(-res));
+    } else if ((request = http_init_conn(listen_request, res)) != NULL) {
+        LOG_INFO("new connection fd %d", res);
+
+        request->uring.on = 1;
+        request->uring.io.handler = http_uring_recv_handler;
+        request->uring.io.data = request;
+
+        event_add_timer(request, TIMEOUT_DEFAULT);
+
+        if (http_uring_wait_read(request) < 0) {
+            http_close_conn(request);
+        }
+    }
+
+    /* the kernel ends a multishot accept on errors, arm it again */
+    if (!(flags & IORING_CQE_F_MORE)
+        && uring_accept(listen_request->epfd, listen_request->fd, io) < 0) {
+        LOG_ERROR("accept error");
+    }
+}
+
+int http_uring_wait_read(http_request_t *r) {
+    size_t len = MAX_BUF - (r->last - r->begin);
+
+    /* no more than the ring takes, handle_read copies all of it */
+    if (len == 0 || uring_recv(r->epfd, r->fd, len, &r->uring.io) < 0) {
+        return -1;
+    }
+    r->uring.inflight++;
+
+    return 0;
+}
+
+static void http_uring_recv_handler(uring_io_t *io, int res, uint32_t flags) {
+    http_request_t *request = (http_request_t *)io->data;
+
+    (void) flags;
+
+    request->uring.inflight--;
+    if (request->uring.closing) {
+        http_close_conn(request);
+        return;
+    }
+
+    /* every buffer was taken, they are back by the next wait */
+    if (res == -ENOBUFS) {
+        if (http_uring_wait_read(request) < 0) {
+            http_close_conn(request);
+        }
+        return;
+    }
+
+    request->uring.res = res;
+
+    event_busy_timer(request);
+    handle_read(request);
+}
+
+/* the buffer of the recv is given back to the ring once the handler returns */
+ssize_t http_uring_read(http_request_t *r, char *buf, size_t len) {
+    int n = r->uring.res;
+
+    r->uring.res = -EAGAIN;
+
+    if (n < 0) {
+        errno = -n;
+        return -1;
+    }
+
+    if ((size_t)n > len) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (n > 0) {
+        memcpy(buf, r->uring.io.buf, n);
+    }
+
+    return n;
+}
+
+int http_uring_flush(http_request_t *r) {
+    int n = http_chain_submit(r->chain, r->epfd, http_uring_send_handler, r);
+
+    if (n < 0) {
+        return RETURN_ERROR;
+    }
+
+    if (n == 0) {
+        return RETURN_OK;
+    }
+
+    r->uring.inflight += n;
+
+    return AGAIN;
+}
+
+static void http_uring_send_handler(uring_io_t *io, int res, uint32_t flags) {
+    http_chain_op_t *op = (http_chain_op_t *)io;
+    http_request_t *request = (http_request_t *)io->data;
+    int ret;
+
+    (void) flags;
+
+    op->res = res;
+
+    /* the rest of the run is still on the ring */
+    if (--request->uring.inflight > 0) {
+        return;
+    }
+
+    if (request->uring.closing) {
+        http_close_conn(request);
+        return;
+    }
+
+    ret = http_chain_complete(request->chain);
+    if (ret == AGAIN) {
+        ret = http_uring_flush(request);
+    }
+
+    if (ret == AGAIN) {
+        event_add_timer(request, TIMEOUT_DEFAULT);
+        return;
+    }
+
+    if (ret != RETURN_OK) {
+        LOG_ERROR("send response error");
+        http_close_conn(request);
+        return;
+    }
+
+    /* the chain is out, answer the requests still waiting in the ring buffer */
+    event_busy_timer(request);
+    handle_write(request);
+}
@@ -0,0 +1,159 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <sched.h>
+#include <gperftools/tcmalloc.h>
+
+#include "http.h"
+#include "http_request.h"
+#include "reactor.h"
+#include "epoll.h"
+#include "uring.h"
+#include "http_uring.h"
+#include "timer.h"
+#include "clock.h"
+#include "ring_log.h"
+
+void *reactor_loop(void *arg)
+{
+    reactor_t *reactor = arg;
+    http_request_t *r;
+    uint64_t timer;
+    int nready;
+
+    LOG_INFO("reactor %d started, listenfd %d", reactor->id, reactor->listenfd);
+
+    timer_shard_self = &reactor->timers;
+
+    while(1)
+    {
+        timer = event_find_timer();
+        nready = Epoll_Wait(reactor->epfd, reactor->events, REACTOR_MAXEVENTS, timer);
+        clock_update();
+        event_process_posted();
+
+        for(int i = 0; i < nready; i++) {
+            /* accept, recv and send of the connections on the ring, see http_uring.c */
+            if(reactor->events[i].events & URING_EPOLL_COMPLETION) {
+                uring_complete(reactor->events[i].data.ptr);
+                continue;
+            }
+
+            if(reactor->events[i].data.ptr == (void *)&reactor->timers) {
+                continue;
+            }
+
+            r = (http_request_t *)reactor->events[i].data.ptr;
+
+            if(r == reactor->listen_request) {
+                handle_conn((void *)r);
+            } else {
+                /* errors and hangups show up in read/write */
+                event_busy_timer(r);
+                if(r->conn_state == HTTP_CONN_READ) {
+                    handle_read((void *)r);
+                } else {
+                    handle_write((void *)r);
+                }
+            }
+        }
+
+        // check timeout event
+        event_expire_timers();
+    }
+
+    return NULL;
+}
+
+static int reactor_setup(reactor_t *reactor, int id, conf_t *cf)
+{
+    struct epoll_event event;
+
+    reactor->id = id;
+    reactor->listenfd = open_listenfd(cf->port, 1);
+    if(reactor->listenfd < 0) {
+        perror("open_listenfd error");
+        return -1;
+    }
+    set_socket_non_blocking(reactor->listenfd);
+
+    reactor->epfd = Epoll_Create(0);
+    if(reactor->epfd < 0) {
+        return -1;
+    }
+
+    reactor->events = (struct epoll_event *)tc_malloc(sizeof(struct epoll_event) * REACTOR_MAXEVENTS);
+    reactor->listen_request = (http_request_t *)tc_malloc(sizeof(http_request_t));
+    if(reactor->events == NULL || reactor->listen_request == NULL) {
+        perror("memory error");
+        return -1;
+    }
+    init_request_t(reactor->listen_request, reactor->listenfd, reactor->epfd, cf);
+    reactor->listen_request->timer_shard = &reactor->timers;
+
+    if(event_timer_shard_init(&reactor->timers, reactor->epfd) < 0) {
+        perror("timer init error");
+        return -1;
+    }
+
+    /*
+    *   the loop runs every handler of its connections, so on io_uring it
+    *   does their io on the ring. Kernels before 5.19 get readiness only
+    */
+    if(event_backend_selected() == &uring_backend) {
+        if(http_uring_listen(reactor->listen_request) == 0) {
+            return 0;
+        }
+        LOG_INFO("reactor %d: no completion io on this kernel, polls only", id);
+    }
+
+    event.data.ptr = (void *)reactor->listen_request;
+    event.events = EPOLLIN | EPOLLET;
+    Epoll_Add(reactor->epfd, reactor->listenfd, &event);
+
+    return 0;
+}
+
+reactor_t *reactor_init(int num_reactors, conf_t *cf)
+{
+    reactor_t *reactors;
+    cpu_set_t cpuset;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int ret;
+
+    reactors = (reactor_t *)tc_malloc(sizeof(reactor_t) * num_reactors);
+    if(reactors == NULL) {
+        perror("memory error");
+        return NULL;
+    }
+
+    /* all listening sockets must be bound before any loop starts accepting */
+    for(int i = 0; i < num_reactors; i++) {
+        if(reactor_setup(&reactors[i], i, cf) < 0) {
+            return NULL;
+        }
+    }
+
+    for(int i = 0; i < num_reactors; i++) {
+        ret = pthread_create(&reactors[i].tid, NULL, reactor_loop, (void *)&reactors[i]);
+        if(ret != 0) {
+            perror("pthread_create error");
+            return NULL;
+        }
+
+        /* keep every loop on its own core */
+        if(ncpus > 0) {
+            CPU_ZERO(&cpuset);
+            CPU_SET(i % ncpus, &cpuset);
+            pthread_setaffinity_np(reactors[i].tid, sizeof(cpu_set_t), &cpuset);
+        }
+    }
+
+    return reactors;
+}
+
+void reactor_wait(reactor_t *reactors, int num_reactors)
+{
+    for(int i = 0; i < num_reactors; i++) {
+        pthread_join(reactors[i].tid, NULL);
+    }
+}
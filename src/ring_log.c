@@ -8,6 +8,7 @@
 #include <gperftools/tcmalloc.h>
 
 #include "ring_log.h"
+#include "clock.h"
 
 // declare ring log and it's singleton
 static ring_log_t *RING_LOG;
@@ -51,38 +52,29 @@ void init_utc_timer(utc_timer_t *utc_timer) {
 }
 
 uint64_t get_curr_time(utc_timer_t *utc_timer, int *p_msec) {
-    struct timeval tv;
-    // get current ts
-    gettimeofday(&tv, NULL);
+    // the event loops keep the clock up to date, no syscall here
+    clock_time_t *tp = clock_time();
+    int64_t msec = clock_msec() - (uint64_t)tp->sec * 1000;
+
     if(p_msec) {
-        *p_msec = tv.tv_usec / 1000;
+        // msec and the slot are published separately, stay inside the second
+        *p_msec = msec < 0 ? 0 : (msec > 999 ? 999 : (int)msec);
     }
 
     // if not in same seconds
-    if((uint32_t)tv.tv_sec != utc_timer->sys_acc_sec) {
-        utc_timer->sec = tv.tv_sec % 60;
-        utc_timer->sys_acc_sec = tv.tv_sec;
-        // or if not in same minutes
-        if(utc_timer->sys_acc_sec / 60 != utc_timer->min) {
-            //use sys_acc_sec update year, mon, day, hour, min, sec
-            utc_timer->sys_acc_min = utc_timer->sys_acc_sec / 60;
-            struct tm cur_tm;
-            localtime_r((time_t*)&utc_timer->sys_acc_sec, &cur_tm);
-            utc_timer->year = cur_tm.tm_year + 1900;
-            utc_timer->mon  = cur_tm.tm_mon + 1;
-            utc_timer->day  = cur_tm.tm_mday;
-            utc_timer->hour = cur_tm.tm_hour;
-            utc_timer->min  = cur_tm.tm_min;
-            //reformat utc format
-            reset_utc_format(utc_timer);
-        }
-        else {
-            //reformat utc format only sec
-            reset_utc_format_sec(utc_timer);
-        }
+    if((uint64_t)tp->sec != utc_timer->sys_acc_sec) {
+        utc_timer->sys_acc_sec = tp->sec;
+        utc_timer->sys_acc_min = tp->sec / 60;
+        utc_timer->year = tp->year;
+        utc_timer->mon  = tp->mon;
+        utc_timer->day  = tp->day;
+        utc_timer->hour = tp->hour;
+        utc_timer->min  = tp->min;
+        utc_timer->sec  = tp->tm_sec;
+        memcpy(utc_timer->utc_format, tp->log_date, sizeof(tp->log_date));
     }
 
-    return tv.tv_sec;
+    return tp->sec;
 }
 
 
@@ -1,13 +1,32 @@
 #include <stdlib.h>
-#include <signal.h>
 #include <assert.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <gperftools/tcmalloc.h>
 
 #include "threadpool.h"
+#include "clock.h"
+#include "ring_log.h"
 
-static pthread_t master_tid;
 static volatile int global_num_thread = 0;
 
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()     __asm__ __volatile__("pause" ::: "memory")
+#else
+#define cpu_relax()     __asm__ __volatile__("" ::: "memory")
+#endif
+
+static inline int futex_wait(volatile int *uaddr, int val)
+{
+    return syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline int futex_wake(volatile int *uaddr, int n)
+{
+    return syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
 static int tpool_queue_empty(tpool_t *tpool)
 {
     int i;
@@ -27,67 +46,135 @@ static thread_t* round_robin_schedule(tpool_t *tpool)
     return &tpool->threads[cur_thread_index];
 }
 
-static void sig_do_nothing(int signo)
+/*
+ * Place work on the shorter queue of the next two round robin candidates,
+ * idle workers steal whatever imbalance is left.
+ */
+static thread_t* work_stealing_schedule(tpool_t *tpool)
 {
-    return;
+    thread_t *first, *second;
+
+    first = round_robin_schedule(tpool);
+    second = &tpool->threads[(first->index + 1) % tpool->num_threads];
+
+    if (thread_queue_len(second) < thread_queue_len(first)) {
+        return second;
+    }
+    return first;
 }
 
-static tpool_work_t *get_work_concurrently(thread_t *thread)
+/*
+ * Both the owner and thieves take work from thread->out with a CAS.
+ * The work is copied before the CAS, once out moves on the master may
+ * reuse the slot.
+ */
+static int get_work_concurrently(thread_t *thread, tpool_work_t *work)
 {
-    tpool_work_t *work;
-    uint8_t tmp;
+    uint32_t tmp;
 
     do {
-        work = NULL;
-        if (thread_queue_len(thread) <= 0) {
-            break;
+        if (thread_queue_len(thread) == 0) {
+            return 0;
         }
 
         tmp = thread->out;
         //prefetch work
-        work = &thread->work_queue[queue_offset(tmp)];
+        *work = thread->work_queue[queue_offset(thread, tmp)];
 
     } while (!__sync_bool_compare_and_swap(&thread->out, tmp, tmp + 1));
 
-    return work;
+    return 1;
 }
 
-void *tpool_thread(void *arg)
+static int steal_work(thread_t *thread, tpool_work_t *work)
 {
-    thread_t *thread = arg;
-    tpool_work_t *work;
-    sigset_t signal_mask, oldmask;
-    int ret, sig_caught;
+    tpool_t *tpool = thread->tpool;
+    thread_t *victim;
+    int i;
 
-    /* SIGUSR1 handler has been set in tpool_init */
-    __sync_fetch_and_add(&global_num_thread, 1);
-    pthread_kill(master_tid, SIGUSR1);
+    for (i = 1; i < tpool->num_threads; i++) {
+        victim = &tpool->threads[(thread->index + i) % tpool->num_threads];
+        if (get_work_concurrently(victim, work)) {
+            debug(TPOOL_DEBUG, "steal work from thread %d", victim->index);
+            return 1;
+        }
+    }
 
-    sigemptyset (&oldmask);
-    sigemptyset (&signal_mask);
-    sigaddset (&signal_mask, SIGUSR1);
+    return 0;
+}
 
-    while (1) {
-        ret = pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
-        if (ret != 0) {
-            debug(TPOOL_ERROR, "SIG_BLOCK failed");
-            pthread_exit(NULL);
+/*
+ * Spin on the queue for a while, then park on thread->sleeping.
+ * sleeping is set before the queue is checked again, and the master
+ * checks sleeping after publishing thread->in, so no wakeup is lost.
+ */
+static void thread_park(thread_t *thread)
+{
+    int i;
+
+    for (i = 0; i < TPOOL_SPIN_COUNT; i++) {
+        if (!thread_queue_empty(thread) || thread->shutdown) {
+            return;
         }
+        cpu_relax();
+    }
 
-        while (thread_queue_empty(thread) && !thread->shutdown) {
-            debug(TPOOL_DEBUG, "I'm sleep");
-            ret = sigwait (&signal_mask, &sig_caught);
-            if (ret != 0) {
-                debug(TPOOL_ERROR, "sigwait failed");
-                pthread_exit(NULL);
-            }
-            debug(TPOOL_DEBUG, "I'm awake");
+    __sync_fetch_and_add(&thread->tpool->num_sleeping, 1);
+    __atomic_store_n(&thread->sleeping, 1, __ATOMIC_SEQ_CST);
+
+    while (thread_queue_empty(thread) && !thread->shutdown) {
+        debug(TPOOL_DEBUG, "I'm sleep");
+        futex_wait(&thread->sleeping, 1);
+        debug(TPOOL_DEBUG, "I'm awake");
+
+        /* woken up by thread_wakeup, maybe to steal work */
+        if (!__atomic_load_n(&thread->sleeping, __ATOMIC_SEQ_CST)) {
+            break;
         }
+    }
 
-        ret = pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
-        if (ret != 0) {
-            debug(TPOOL_ERROR, "SIG_SETMASK failed");
-            pthread_exit(NULL);
+    __atomic_store_n(&thread->sleeping, 0, __ATOMIC_RELAXED);
+    __sync_fetch_and_sub(&thread->tpool->num_sleeping, 1);
+}
+
+/* wake the worker only if it is parked */
+static int thread_wakeup(thread_t *thread)
+{
+    if (__atomic_load_n(&thread->sleeping, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&thread->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        futex_wake(&thread->sleeping, 1);
+        return 1;
+    }
+    return 0;
+}
+
+/* the selected worker is busy with a backlog, let a parked one steal */
+static void wakeup_thief(tpool_t *tpool, thread_t *busy)
+{
+    int i;
+
+    for (i = 1; i < tpool->num_threads; i++) {
+        if (thread_wakeup(&tpool->threads[(busy->index + i) % tpool->num_threads])) {
+            return;
+        }
+    }
+}
+
+void *tpool_thread(void *arg)
+{
+    thread_t *thread = arg;
+    tpool_work_t work;
+
+    __sync_fetch_and_add(&global_num_thread, 1);
+    futex_wake(&global_num_thread, 1);
+
+    while (1) {
+        if (thread_queue_empty(thread) && !thread->shutdown) {
+            if (thread->tpool->steal && steal_work(thread, &work)) {
+                (*(work.call_back))(work.arg);
+                continue;
+            }
+            thread_park(thread);
         }
 
         if (thread->shutdown) {
@@ -95,22 +182,26 @@ void *tpool_thread(void *arg)
             pthread_exit(NULL);
         }
 
-        work = get_work_concurrently(thread);
-        if (work) {
-            (*(work->call_back))(work->arg);
+        if (get_work_concurrently(thread, &work)) {
+            (*(work.call_back))(work.arg);
         }
-
-        if (thread_queue_empty(thread)) {
-            pthread_kill(master_tid, SIGUSR1);
-        }       
     }
 }
 
-static void spawn_new_thread(tpool_t *tpool, int index)
+static void spawn_new_thread(tpool_t *tpool, int index, int queue_power)
 {   
     int ret;
 
     memset(&tpool->threads[index], 0, sizeof(thread_t));
+    tpool->threads[index].index = index;
+    tpool->threads[index].tpool = tpool;
+    tpool->threads[index].queue_mask = (1u << queue_power) - 1;
+    tpool->threads[index].work_queue = (tpool_work_t *)tc_malloc(sizeof(tpool_work_t) << queue_power);
+    if (tpool->threads[index].work_queue == NULL) {
+        debug(TPOOL_ERROR, "tc_malloc failed");
+        exit(0);
+    }
+
     ret = pthread_create(&tpool->threads[index].tid, NULL, tpool_thread,
                        (void *)(&tpool->threads[index]));
 
@@ -122,37 +213,16 @@ static void spawn_new_thread(tpool_t *tpool, int index)
 
 static int wait_for_thread_registration(int num_expected)
 {
-    sigset_t signal_mask, oldmask;
-    int ret, sig_caught;
-
-    sigemptyset (&oldmask);
-    sigemptyset (&signal_mask);
-    sigaddset (&signal_mask, SIGUSR1);
-
-    ret = pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
-    if (ret != 0) {
-        debug(TPOOL_ERROR, "SIG_BLOCK failed");
-        return -1;
-    }
+    int num;
 
-    while (global_num_thread < num_expected) {
-        ret = sigwait (&signal_mask, &sig_caught);
-        if (ret != 0) {
-            debug(TPOOL_ERROR, "sigwait failed");
-            return -1;
-        }
-    }
-
-    ret = pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
-    if (ret != 0) {
-        debug(TPOOL_ERROR, "SIG_SETMASK failed");
-        return -1;
+    while ((num = global_num_thread) < num_expected) {
+        futex_wait(&global_num_thread, num);
     }
 
     return 0;
 }
 
-tpool_t *tpool_init(int num_threads)
+tpool_t *tpool_init(int num_threads, int schedule, int queue_power)
 {
     int i;
     tpool_t *tpool;
@@ -165,22 +235,24 @@ tpool_t *tpool_init(int num_threads)
 
     memset(tpool, 0, sizeof(*tpool));
     tpool->num_threads = num_threads;
-    tpool->schedule_thread = round_robin_schedule;
+    if (schedule == TPOOL_WORK_STEALING) {
+        tpool->schedule_thread = work_stealing_schedule;
+        tpool->steal = 1;
+    } else {
+        tpool->schedule_thread = round_robin_schedule;
+    }
     tpool->threads = (thread_t *)tc_malloc(sizeof(thread_t) * num_threads);
     if(tpool->threads == NULL) {
         debug(TPOOL_ERROR, "tc_malloc failed");
         return NULL;
     }
 
-    /* all threads are set SIGUSR1 with sig_do_nothing */
-    if (signal(SIGUSR1, sig_do_nothing) == SIG_ERR) {
-        debug(TPOOL_ERROR, "signal failed");
-        return NULL;
+    if (queue_power <= 0 || queue_power > WORK_QUEUE_POWER_MAX) {
+        queue_power = WORK_QUEUE_POWER;
     }
-    master_tid = pthread_self();
 
     for (i = 0; i < tpool->num_threads; i++) {
-        spawn_new_thread(tpool, i);
+        spawn_new_thread(tpool, i, queue_power);
     }
         
     if (wait_for_thread_registration(tpool->num_threads) < 0) {
@@ -196,77 +268,85 @@ static int dispatch_work2thread(tpool_t *tpool, thread_t *thread,
     tpool_work_t *work = NULL;
 
     if (thread_queue_full(thread)) {
-        debug(TPOOL_WARNING, "queue of thread selected is full!!!");
         return -1;
     }
 
-    work = &thread->work_queue[queue_offset(thread->in)];
+    work = &thread->work_queue[queue_offset(thread, thread->in)];
     work->call_back = call_back;
     work->arg = arg;
-    thread->in++;
-    
-    if (thread_queue_len(thread) == 1) {
-        debug(TPOOL_DEBUG, "signal has task");
-        pthread_kill(thread->tid, SIGUSR1);
+    /* release: the slot is written before a worker can see the new in */
+    __atomic_store_n(&thread->in, thread->in + 1, __ATOMIC_RELEASE);
+
+    /* publish thread->in before looking at thread->sleeping */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!thread_wakeup(thread) && tpool->steal &&
+        thread_queue_len(thread) > 1 && tpool->num_sleeping > 0) {
+        wakeup_thief(tpool, thread);
     }
 
     return 0;
 }
 
+/*
+ * Returns -1 only when the queues of all workers are full, the caller then
+ * has to run the work itself (see dispatch in Server.c).
+ */
 int tpool_add_work(tpool_t *tpool, void (*call_back)(void *), void *arg)
 {
     thread_t *thread;
+    int i;
 
     assert(tpool);
     thread = tpool->schedule_thread(tpool);
-    return dispatch_work2thread(tpool, thread, call_back, arg);
+    if (dispatch_work2thread(tpool, thread, call_back, arg) == 0) {
+        return 0;
+    }
+
+    /* queue of thread selected is full, retry on the others */
+    for (i = 1; i < tpool->num_threads; i++) {
+        if (dispatch_work2thread(tpool, &tpool->threads[(thread->index + i) % tpool->num_threads],
+                                    call_back, arg) == 0) {
+            return 0;
+        }
+    }
+
+    /* only the dispatcher adds work, one log line a second at most */
+    tpool->overflows++;
+    if (tpool->overflow_report != clock_time()->sec) {
+        tpool->overflow_report = clock_time()->sec;
+        LOG_WARN("queues of all threads are full, %lu works run by the dispatcher so far",
+                 (unsigned long)tpool->overflows);
+    }
+    return -1;
 }
 
 void tpool_destroy(tpool_t *tpool)
 {
-    sigset_t signal_mask, oldmask;
-    int ret, sig_caught;
     int i;
 
     assert(tpool);
 
     debug(TPOOL_DEBUG, "wait all work done");
 
-    sigemptyset (&oldmask);
-    sigemptyset (&signal_mask);
-    sigaddset (&signal_mask, SIGUSR1);
-
-    ret = pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
-    if (ret != 0) {
-        debug(TPOOL_ERROR, "SIG_BLOCK failed");
-        pthread_exit(NULL);
-    }
-
+    /* workers no longer report a drained queue, poll until all are empty */
     while (!tpool_queue_empty(tpool)) {
-        ret = sigwait(&signal_mask, &sig_caught);
-        if (ret != 0) {
-            debug(TPOOL_ERROR, "sigwait failed");
-            pthread_exit(NULL);
-        }
-    }
-
-    ret = pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
-    if (ret != 0) {
-        debug(TPOOL_ERROR, "SIG_SETMASK failed");
-        pthread_exit(NULL);
+        sched_yield();
     }
 
     /* shutdown all threads */
     for (i = 0; i < tpool->num_threads; i++) {
-        tpool->threads[i].shutdown = 1;
+        __atomic_store_n(&tpool->threads[i].shutdown, 1, __ATOMIC_SEQ_CST);
         /* wake up thread */
-        pthread_kill(tpool->threads[i].tid, SIGUSR1);
+        thread_wakeup(&tpool->threads[i]);
     }
     debug(TPOOL_DEBUG, "wait worker thread exit");
     for (i = 0; i < tpool->num_threads; i++) {
         pthread_join(tpool->threads[i].tid, NULL);
     }
 
+    for (i = 0; i < tpool->num_threads; i++) {
+        tc_free(tpool->threads[i].work_queue);
+    }
     tc_free(tpool->threads);
     tc_free(tpool);
 }
\ No newline at end of file
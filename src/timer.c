@@ -2,14 +2,15 @@
 #include <stddef.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
 
 #include "http_request.h"
 #include "timer.h"
+#include "clock.h"
 #include "epoll.h"
 
-rbtree_t         event_timer_rbtree;
-rbtree_node_t    event_timer_sentinel;
-pthread_mutex_t  event_timer_mutex;
+int              event_timer_type;
+__thread timer_shard_t *timer_shard_self;
 
 void timeout_handle(http_request_t *request) {
     struct epoll_event ev = {0, {0}};
@@ -20,45 +21,265 @@ void timeout_handle(http_request_t *request) {
 }
 
 /* 定时器事件初始化 */
-int event_timer_init()
+int event_timer_init(int type)
 {
+    event_timer_type = type;
+
+    LOG_INFO("timer init: %s", type == EVENT_TIMER_WHEEL ? "wheel" : "rbtree");
+
+    return 1;
+}
+
+int event_timer_shard_init(timer_shard_t *shard, int epfd)
+{
+    struct epoll_event event;
+
     /* 初始化红黑树 */
-    rbtree_init(&event_timer_rbtree, &event_timer_sentinel,
+    rbtree_init(&shard->rbtree, &shard->sentinel,
                     rbtree_insert_timer_value);
 
-    int ret = pthread_mutex_init(&event_timer_mutex, NULL);
-    if (ret < 0) {
+    /* 初始化时间轮 */
+    timer_wheel_init(&shard->wheel, clock_msec());
+
+    shard->posted = NULL;
+    shard->sleep_until = 0;
+
+    shard->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shard->wakefd < 0) {
         return -1;
     }
 
-    LOG_INFO("timer init");
+    /*
+    *   edge triggered: every write to the eventfd is a new edge, so the
+    *   counter never has to be read back
+    */
+    event.data.ptr = (void *)shard;
+    event.events = EPOLLIN | EPOLLET;
+    Epoll_Add(epfd, shard->wakefd, &event);
 
-    return 1;
+    return 0;
 }
 
-uint64_t event_find_timer(void) {
-    int64_t timer;
-    rbtree_node_t *node, *root, *sentinel;
-    struct timeval tv;
-    uint64_t curr_msec;
+/* 以下函数只能由shard的所属线程调用 */
+static int shard_del_timer(timer_shard_t *shard, http_request_t *request)
+{
+    if (!request->timerset) {
+        /*
+        *   request->timerset=0, 说明request->timer被删除
+        */
+        return -1;
+    }
 
-    /* 若红黑树为空 */
-    if (event_timer_rbtree.root == &event_timer_sentinel) {
-        return TIMER_INFINITE;
+    if (event_timer_type == EVENT_TIMER_WHEEL) {
+        timer_wheel_del(&shard->wheel, &request->wheel);
+    } else {
+        /* 从红黑树中移除指定事件的节点对象 */
+        rbtree_delete(&shard->rbtree, &request->timer);
+
+        request->timer.left = NULL;
+        request->timer.right = NULL;
+        request->timer.parent = NULL;
     }
+    /* 删除后，timerset要置为0 */
+    request->timerset = 0;
+
+    return 0;
+}
 
-    pthread_mutex_lock(&event_timer_mutex);
+static void shard_insert_timer(timer_shard_t *shard, http_request_t *request, uint64_t key)
+{
+    request->timer.key = key;
+    request->wheel.key = key;
 
-    root = event_timer_rbtree.root;
-    sentinel = event_timer_rbtree.sentinel;
+    if (event_timer_type == EVENT_TIMER_WHEEL) {
+        timer_wheel_add(&shard->wheel, &request->wheel);
+    } else {
+        /* 将事件对象节点插入到红黑树中 */
+        rbtree_insert(&shard->rbtree, &request->timer);
+    }
+    /* timerset=1, 表示request->timer在定时器上 */
+    request->timerset = 1;
+}
 
-    /* 找出红黑树最小的节点，即最左边的节点 */
-    node = rbtree_min(root, sentinel);
+static void shard_add_timer(timer_shard_t *shard, http_request_t *request)
+{
+    uint64_t key = __atomic_load_n(&request->timer_deadline, __ATOMIC_RELAXED);
+
+    request->timer_busy = 0;
+
+    if (request->timerset) {
+        /* 新旧超时时间相差不大, 不移动定时器, 超时时再检查timer_deadline */
+        if (key >= request->timer.key && key - request->timer.key <= TIMER_LAZY_DELAY) {
+            return;
+        }
+
+        shard_del_timer(shard, request);
+    }
 
-    pthread_mutex_unlock(&event_timer_mutex);
+    shard_insert_timer(shard, request, key);
+}
 
-    gettimeofday(&tv, NULL);
-    curr_msec = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+static void shard_free_timer(timer_shard_t *shard, http_request_t *request)
+{
+    shard_del_timer(shard, request);
+    free_request_t(request);
+}
+
+/*
+*   an expired timer whose connection is still in use: returns 1 and moves
+*   the timer to the real deadline, or rechecks a busy request a bit later
+*/
+static int shard_timer_alive(timer_shard_t *shard, http_request_t *request, uint64_t curr_msec)
+{
+    uint64_t deadline = __atomic_load_n(&request->timer_deadline, __ATOMIC_RELAXED);
+
+    if ((int64_t)(deadline - curr_msec) > 0) {
+        shard_insert_timer(shard, request, deadline);
+        return 1;
+    }
+
+    if (request->timer_busy) {
+        shard_insert_timer(shard, request, curr_msec + TIMER_LAZY_DELAY);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+*   push the operation to the owner of the shard. The calling thread owns
+*   the request until it arms the fd again, so a request is posted at most
+*   once per pass of the owner's loop and timer_next is free to use
+*/
+static void shard_post(timer_shard_t *shard, http_request_t *request, int op, uint64_t key)
+{
+    http_request_t *head;
+
+    request->timer_op = op;
+
+    head = __atomic_load_n(&shard->posted, __ATOMIC_RELAXED);
+    do {
+        request->timer_next = head;
+    } while (!__atomic_compare_exchange_n(&shard->posted, &head, request, 1,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    if (op != EVENT_TIMER_OP_ADD) {
+        return;
+    }
+
+    /* the owner sleeps past the new timer, only the first poster wakes it */
+    if (key < __atomic_load_n(&shard->sleep_until, __ATOMIC_SEQ_CST)
+        && __atomic_exchange_n(&shard->sleep_until, 0, __ATOMIC_SEQ_CST) != 0) {
+        eventfd_write(shard->wakefd, 1);
+    }
+}
+
+int event_del_timer(http_request_t *request)
+{
+    timer_shard_t *shard = request->timer_shard;
+
+    LOG_INFO("event timer del: %d: %M",
+          request->fd, request->timer.key);
+
+    if (shard == timer_shard_self) {
+        return shard_del_timer(shard, request);
+    }
+
+    shard_post(shard, request, EVENT_TIMER_OP_DEL, 0);
+
+    return 0;
+}
+
+void event_busy_timer(http_request_t *request)
+{
+    /* only the owner of the shard dispatches handlers */
+    request->timer_busy = 1;
+}
+
+void event_free_timer(http_request_t *request)
+{
+    timer_shard_t *shard = request->timer_shard;
+
+    if (shard == timer_shard_self) {
+        shard_free_timer(shard, request);
+        return;
+    }
+
+    shard_post(shard, request, EVENT_TIMER_OP_FREE, 0);
+}
+
+void event_add_timer(http_request_t *request, uint64_t timer)
+{
+    timer_shard_t *shard = request->timer_shard;
+    uint64_t key;
+
+    /*
+    *   the node keys belong to the owner: the timer of a busy request is
+    *   still linked while another thread runs its handler
+    */
+    key = clock_msec() + timer;
+    __atomic_store_n(&request->timer_deadline, key, __ATOMIC_RELAXED);
+
+    LOG_INFO("event timer add: %d: %M:%M",
+          request->fd, timer, key);
+
+    if (shard == timer_shard_self) {
+        shard_add_timer(shard, request);
+        return;
+    }
+
+    shard_post(shard, request, EVENT_TIMER_OP_ADD, key);
+}
+
+/*
+*   apply the operations posted by other threads. Called right after every
+*   wait: a worker posts before it arms the fd, so the timer of a request is
+*   always in place before the request's next event is dispatched
+*/
+void event_process_posted(void)
+{
+    timer_shard_t *shard = timer_shard_self;
+    http_request_t *request, *next;
+
+    __atomic_store_n(&shard->sleep_until, 0, __ATOMIC_SEQ_CST);
+
+    request = __atomic_exchange_n(&shard->posted, NULL, __ATOMIC_ACQUIRE);
+
+    while (request != NULL) {
+        next = request->timer_next;
+
+        switch (request->timer_op) {
+            case EVENT_TIMER_OP_ADD:
+                shard_add_timer(shard, request);
+                break;
+            case EVENT_TIMER_OP_DEL:
+                shard_del_timer(shard, request);
+                break;
+            case EVENT_TIMER_OP_FREE:
+                shard_free_timer(shard, request);
+                break;
+        }
+
+        request = next;
+    }
+}
+
+static uint64_t shard_find_timer(timer_shard_t *shard, uint64_t curr_msec) {
+    int64_t timer;
+    rbtree_node_t *node;
+
+    if (event_timer_type == EVENT_TIMER_WHEEL) {
+        timer = timer_wheel_next(&shard->wheel, curr_msec);
+        return timer == -1 ? (uint64_t)TIMER_INFINITE : (uint64_t)timer;
+    }
+
+    /* 若红黑树为空 */
+    if (shard->rbtree.root == &shard->sentinel) {
+        return TIMER_INFINITE;
+    }
+
+    /* 找出红黑树最小的节点，即最左边的节点 */
+    node = rbtree_min(shard->rbtree.root, shard->rbtree.sentinel);
 
     /* 计算最左节点键值与当前时间的差值timer，当timer大于0表示不超时，不大于0表示超时 */
     timer = (int64_t)(node->key - curr_msec);
@@ -70,53 +291,97 @@ uint64_t event_find_timer(void) {
     return (uint64_t)(timer > 0 ? timer : 0);
 }
 
+uint64_t event_find_timer(void) {
+    timer_shard_t *shard = timer_shard_self;
+    uint64_t timer, curr_msec;
+
+    for (;;) {
+        event_process_posted();
+
+        curr_msec = clock_msec();
+        timer = shard_find_timer(shard, curr_msec);
+
+        /* publish the wake up time, then look for posts that raced with it */
+        __atomic_store_n(&shard->sleep_until,
+                         timer == (uint64_t)TIMER_INFINITE ? UINT64_MAX : curr_msec + timer,
+                         __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&shard->posted, __ATOMIC_SEQ_CST) == NULL) {
+            return timer;
+        }
+    }
+}
+
 
 /* 检查定时器中所有事件 */
 void event_expire_timers(void) {
+    timer_shard_t   *shard = timer_shard_self;
     http_request_t  *request;
-    rbtree_node_t   *node, *root, *sentinel;
-    uint64_t curr_msec;
-    struct timeval tv;
+    rbtree_node_t   *node, *sentinel;
+    timer_wheel_node_t *wnode;
+    list_head       expired;
+    uint64_t        curr_msec;
+
+    curr_msec = clock_msec();
+
+    if (event_timer_type == EVENT_TIMER_WHEEL) {
+        INIT_LIST_HEAD(&expired);
+
+        /* 取出所有超时的节点 */
+        timer_wheel_expire(&shard->wheel, curr_msec, &expired);
+
+        while (!list_empty(&expired)) {
+            wnode = list_entry(expired.next, timer_wheel_node_t, list);
+            list_del(&wnode->list);
+
+            request = (http_request_t *) ((char *) wnode - offsetof(http_request_t, wheel));
+            request->timerset = 0;
+
+            if (shard_timer_alive(shard, request, curr_msec)) {
+                continue;
+            }
 
-    sentinel = event_timer_rbtree.sentinel;
+            LOG_INFO("socket %d time out", request->fd);
+
+            /* 超时处理函数 */
+            timeout_handle(request);
+        }
+
+        return;
+    }
 
-    gettimeofday(&tv, NULL);
-    curr_msec = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    sentinel = shard->rbtree.sentinel;
 
     /* 循环检查 */
     for(;;) {
-        
-        pthread_mutex_lock(&event_timer_mutex);
-
-        root = event_timer_rbtree.root;
 
         /* 若定时器红黑树为空，则直接返回，不做任何处理 */
-        if(root == sentinel) {
-            pthread_mutex_unlock(&event_timer_mutex);
+        if(shard->rbtree.root == sentinel) {
             return;
         }
 
         /* 找出定时器红黑树最左边的节点，即最小的节点，同时也是最有可能超时的事件对象 */
-        node = rbtree_min(root, sentinel);
+        node = rbtree_min(shard->rbtree.root, sentinel);
 
         /* node->key <= ngx_current_time */
         /* 若检查到的当前事件已超时 */
-        if ((int64_t) (node->key - curr_msec) <= 0) {
-            /* 获取超时的具体事件 */
-            request = (http_request_t *) ((char *) node - offsetof(http_request_t, timer));
+        if ((int64_t) (node->key - curr_msec) > 0) {
+            return;
+        }
 
-            LOG_INFO("socket %d time out", request->fd);
+        /* 获取超时的具体事件 */
+        request = (http_request_t *) ((char *) node - offsetof(http_request_t, timer));
 
-            /* 将已超时事件对象从现有定时器红黑树中移除 */
-            rbtree_delete(&event_timer_rbtree, &request->timer);
-            /* 超时处理函数 */
-            timeout_handle(request);
+        /* 将已超时事件对象从现有定时器红黑树中移除 */
+        shard_del_timer(shard, request);
 
+        if (shard_timer_alive(shard, request, curr_msec)) {
             continue;
         }
 
-        break;
-    }
+        LOG_INFO("socket %d time out", request->fd);
 
-    pthread_mutex_unlock(&event_timer_mutex);
-}
\ No newline at end of file
+        /* 超时处理函数 */
+        timeout_handle(request);
+    }
+}
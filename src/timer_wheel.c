@@ -0,0 +1,135 @@
+#include "timer_wheel.h"
+
+#define TVN_INDEX(curr, level)  (((curr) >> (TVR_BITS + (level) * TVN_BITS)) & TVN_MASK)
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t curr_msec)
+{
+    int i, j;
+
+    wheel->curr = curr_msec;
+    wheel->count = 0;
+
+    for (i = 0; i < TVR_SIZE; i++) {
+        INIT_LIST_HEAD(&wheel->tv1[i]);
+    }
+
+    for (i = 0; i < TVN_LEVELS; i++) {
+        for (j = 0; j < TVN_SIZE; j++) {
+            INIT_LIST_HEAD(&wheel->tvn[i][j]);
+        }
+    }
+}
+
+/* 按照剩余的tick数选择所在的层和槽 */
+static void timer_wheel_internal_add(timer_wheel_t *wheel, timer_wheel_node_t *node)
+{
+    uint64_t expires = node->key;
+    uint64_t idx = expires - wheel->curr;
+    list_head *slot;
+    int level;
+
+    if ((int64_t)idx < 0) {
+        /* already expired, handle it on the next tick */
+        slot = &wheel->tv1[wheel->curr & TVR_MASK];
+
+    } else if (idx < TVR_SIZE) {
+        slot = &wheel->tv1[expires & TVR_MASK];
+
+    } else {
+        if (idx > TIMER_WHEEL_MAX_TICKS) {
+            expires = wheel->curr + TIMER_WHEEL_MAX_TICKS;
+            idx = TIMER_WHEEL_MAX_TICKS;
+        }
+
+        for (level = 0; level < TVN_LEVELS - 1; level++) {
+            if (idx < 1ULL << (TVR_BITS + (level + 1) * TVN_BITS)) {
+                break;
+            }
+        }
+        slot = &wheel->tvn[level][TVN_INDEX(expires, level)];
+    }
+
+    list_add_tail(&node->list, slot);
+}
+
+/* 将上层槽中的定时器重新分配到下层 */
+static int timer_wheel_cascade(timer_wheel_t *wheel, int level, int index)
+{
+    list_head *slot = &wheel->tvn[level][index];
+    timer_wheel_node_t *node;
+
+    while (!list_empty(slot)) {
+        node = list_entry(slot->next, timer_wheel_node_t, list);
+        list_del(&node->list);
+        timer_wheel_internal_add(wheel, node);
+    }
+
+    return index;
+}
+
+void timer_wheel_add(timer_wheel_t *wheel, timer_wheel_node_t *node)
+{
+    timer_wheel_internal_add(wheel, node);
+    wheel->count++;
+}
+
+void timer_wheel_del(timer_wheel_t *wheel, timer_wheel_node_t *node)
+{
+    list_del(&node->list);
+    wheel->count--;
+}
+
+uint64_t timer_wheel_next(timer_wheel_t *wheel, uint64_t curr_msec)
+{
+    uint64_t tick = wheel->curr;
+    int i;
+
+    if (wheel->count == 0) {
+        return (uint64_t)-1;
+    }
+
+    /* the first tick with timers, or the next cascade */
+    for (i = 0; i < TVR_SIZE; i++, tick++) {
+        if (!list_empty(&wheel->tv1[tick & TVR_MASK]) || (tick & TVR_MASK) == 0) {
+            break;
+        }
+    }
+
+    return (int64_t)(tick - curr_msec) > 0 ? tick - curr_msec : 0;
+}
+
+void timer_wheel_expire(timer_wheel_t *wheel, uint64_t curr_msec, list_head *expired)
+{
+    timer_wheel_node_t *node;
+    list_head *slot;
+    int index, level;
+
+    if (wheel->count == 0) {
+        /* nothing to cascade, jump to now */
+        wheel->curr = curr_msec + 1;
+        return;
+    }
+
+    while ((int64_t)(curr_msec - wheel->curr) >= 0) {
+        index = wheel->curr & TVR_MASK;
+
+        /* tv1 wraps, pull the timers of the next range down */
+        if (index == 0) {
+            for (level = 0; level < TVN_LEVELS; level++) {
+                if (timer_wheel_cascade(wheel, level, TVN_INDEX(wheel->curr, level)) != 0) {
+                    break;
+                }
+            }
+        }
+
+        wheel->curr++;
+
+        slot = &wheel->tv1[index];
+        while (!list_empty(slot)) {
+            node = list_entry(slot->next, timer_wheel_node_t, list);
+            list_del(&node->list);
+            list_add_tail(&node->list, expired);
+            wheel->count--;
+        }
+    }
+}
@@ -0,0 +1,768 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <gperftools/tcmalloc.h>
+
+#include "epoll.h"
+#include "uring.h"
+
+/*
+*   io_uring backend.
+*
+*   Readiness is reported with epoll semantics: EPOLL_CTL_ADD/MOD queue an
+*   IORING_OP_POLL_ADD, EPOLL_CTL_DEL an IORING_OP_POLL_REMOVE. The thread
+*   pool mode and the timer wakeups only use these.
+*
+*   The reactors also do their io on the ring (uring.h): a multishot
+*   accept, recv into buffers provided to the ring, and linked sendmsg and
+*   splice. Their completions come out of uring_wait next to the polls.
+*
+*   Only the thread waiting on the ring (its owner) touches the submission
+*   queue, so there is no lock. Its requests are submitted together with
+*   the next wait, one io_uring_enter per loop iteration. Other threads
+*   (the workers of the thread pool) push their requests to a lock-free
+*   stack that the owner drains before it waits, or before a request of
+*   its own so the requests of an fd keep their order; wakefd wakes the
+*   owner if it is asleep.
+*
+*   A poll is tagged with the generation of its fd: user_data is
+*   URING_UDATA_POLL | gen << 32 | fd. Every ADD, MOD and DEL starts a new
+*   generation, so a completion that was already queued for a removed
+*   registration is dropped instead of handing out the data of a freed
+*   request. An io request is tagged with its uring_io_t instead, user
+*   pointers never have the top bit; the owner keeps it until the last
+*   completion.
+*/
+
+#define URING_ENTRIES           4096
+#define URING_MAX_FD            1024    /* rings are created at startup, their fds are small */
+#define URING_SLOTS             1024    /* initial fd table, grows on demand */
+#define URING_UDATA_INTERNAL    0       /* user_data of requests nobody waits for */
+#define URING_UDATA_WAKE        1       /* the poll of wakefd, generation 0 is never used */
+#define URING_UDATA_POLL        (1ULL << 63)
+#define URING_GEN_MASK          0x7fffffff
+
+#define uring_udata(gen, fd)    (URING_UDATA_POLL | (uint64_t)(gen) << 32 | (uint32_t)(fd))
+#define uring_udata_gen(udata)  ((uint32_t)((udata) >> 32) & URING_GEN_MASK)
+
+/* epoll flags that are not poll events */
+#define URING_EPOLL_FLAGS       (EPOLLET | EPOLLONESHOT | EPOLLEXCLUSIVE | EPOLLWAKEUP)
+
+/* the registration of an fd, owned by the owner of the ring */
+typedef struct uring_slot_s {
+    uint32_t    gen;
+    uint32_t    events;
+    uint64_t    data;
+    int         armed;      /* a poll is in flight */
+} uring_slot_t;
+
+/* EPOLL_CTL_* from another thread, applied by the owner */
+typedef struct uring_op_s {
+    struct uring_op_s *next;
+    int         op;
+    int         fd;
+    uint32_t    events;
+    uint64_t    data;
+} uring_op_t;
+
+/* a completion of an io request, valid until the next wait */
+typedef struct uring_done_s {
+    struct uring_s *ring;
+    uring_io_t  *io;
+    int          res;
+    uint32_t     flags;
+} uring_done_t;
+
+typedef struct uring_s {
+    int                  fd;
+
+    /* submission queue */
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_entries;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned             sq_pending;    /* queued, not submitted yet */
+
+    /* completion queue */
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    pthread_t            owner;         /* thread waiting on this ring */
+    int                  owned;
+
+    uring_slot_t        *slots;         /* by fd */
+    int                  nslots;
+
+    uring_op_t          *posted;        /* requests of other threads */
+    int                  sleeping;      /* the owner waits in io_uring_enter */
+    int                  wakefd;
+
+    /* completion io, set up by uring_io_init */
+    struct io_uring_buf_ring *br;       /* buffers provided to recv, group 0 */
+    unsigned short       br_tail;
+    char                *bufs;
+    uring_done_t        *done;          /* completions of the last wait */
+    int                  ndone;
+} uring_t;
+
+static uring_t *rings[URING_MAX_FD];
+
+static int uring_prep_poll(uring_t *ring, int fd, uint32_t events, uint64_t udata, int multishot);
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                            unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static uring_t *uring_lookup(int fd) {
+    if(fd < 0 || fd >= URING_MAX_FD || rings[fd] == NULL) {
+        errno = EBADF;
+        return NULL;
+    }
+    return rings[fd];
+}
+
+static int uring_create(int flags) {
+    struct io_uring_params p;
+    uring_t *ring;
+    size_t sq_size, cq_size;
+    void *sq_ptr, *cq_ptr, *sqes;
+    int fd;
+
+    (void) flags;
+
+    memset(&p, 0, sizeof(p));
+    fd = io_uring_setup(URING_ENTRIES, &p);
+    if(fd < 0) {
+        return -1;
+    }
+
+    /* the timeout of Epoll_Wait is passed with IORING_ENTER_EXT_ARG (5.11) */
+    if(!(p.features & IORING_FEAT_EXT_ARG) || fd >= URING_MAX_FD) {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = (sq_size > cq_size) ? sq_size : cq_size;
+    }
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQ_RING);
+    if(sq_ptr == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd, IORING_OFF_CQ_RING);
+        if(cq_ptr == MAP_FAILED) {
+            munmap(sq_ptr, sq_size);
+            close(fd);
+            return -1;
+        }
+    }
+
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+        goto err;
+    }
+
+    ring = (uring_t *)tc_malloc(sizeof(uring_t));
+    if(ring == NULL) {
+        munmap(sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+        goto err;
+    }
+    memset(ring, 0, sizeof(uring_t));
+
+    ring->fd = fd;
+    ring->sq_head = (unsigned *)((char *)sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)sq_ptr + p.sq_off.ring_mask);
+    ring->sq_entries = (unsigned *)((char *)sq_ptr + p.sq_off.ring_entries);
+    ring->sq_array = (unsigned *)((char *)sq_ptr + p.sq_off.array);
+    ring->sqes = (struct io_uring_sqe *)sqes;
+
+    ring->cq_head = (unsigned *)((char *)cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)cq_ptr + p.cq_off.cqes);
+
+    ring->nslots = URING_SLOTS;
+    ring->slots = (uring_slot_t *)tc_calloc(ring->nslots, sizeof(uring_slot_t));
+    ring->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(ring->slots == NULL || ring->wakefd < 0
+        || uring_prep_poll(ring, ring->wakefd, EPOLLIN, URING_UDATA_WAKE, 1) < 0) {
+        munmap(sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+        if(ring->wakefd >= 0) {
+            close(ring->wakefd);
+        }
+        tc_free(ring->slots);
+        tc_free(ring);
+        goto err;
+    }
+
+    rings[fd] = ring;
+
+    return fd;
+
+err:
+    if(cq_ptr != sq_ptr) {
+        munmap(cq_ptr, cq_size);
+    }
+    munmap(sq_ptr, sq_size);
+    close(fd);
+    return -1;
+}
+
+static int uring_submit(uring_t *ring) {
+    unsigned n = ring->sq_pending;
+    int ret;
+
+    if(n == 0) {
+        return 0;
+    }
+
+    while((ret = io_uring_enter(ring->fd, n, 0, 0, NULL, 0)) < 0) {
+        if(errno == EINTR) continue;
+        return -1;
+    }
+    ring->sq_pending -= ret;
+
+    return ret;
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned head, tail, idx;
+    struct io_uring_sqe *sqe;
+
+    tail = *ring->sq_tail;
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if(tail - head >= *ring->sq_entries) {
+        /* submission queue is full, flush it */
+        if(uring_submit(ring) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if(tail - head >= *ring->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    idx = tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+
+    return sqe;
+}
+
+static void uring_commit_sqe(uring_t *ring) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+}
+
+static int uring_prep_poll(uring_t *ring, int fd, uint32_t events, uint64_t udata, int multishot) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if(sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events & ~URING_EPOLL_FLAGS;
+    if(multishot) {
+        sqe->len = IORING_POLL_ADD_MULTI;
+    }
+    sqe->user_data = udata;
+
+    uring_commit_sqe(ring);
+    return 0;
+}
+
+static int uring_prep_remove(uring_t *ring, uint64_t udata) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if(sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = udata;
+    sqe->user_data = URING_UDATA_INTERNAL;
+
+    uring_commit_sqe(ring);
+    return 0;
+}
+
+static uring_slot_t *uring_slot(uring_t *ring, int fd) {
+    uring_slot_t *slots;
+    int n = ring->nslots;
+
+    if(fd < n) {
+        return &ring->slots[fd];
+    }
+
+    while(n <= fd) {
+        n <<= 1;
+    }
+
+    slots = (uring_slot_t *)tc_realloc(ring->slots, n * sizeof(uring_slot_t));
+    if(slots == NULL) {
+        return NULL;
+    }
+    memset(slots + ring->nslots, 0, (n - ring->nslots) * sizeof(uring_slot_t));
+    ring->slots = slots;
+    ring->nslots = n;
+
+    return &ring->slots[fd];
+}
+
+/* on the owner: queue the requests of an EPOLL_CTL_* */
+static int uring_apply(uring_t *ring, int op, int fd, uint32_t events, uint64_t data) {
+    uring_slot_t *slot;
+
+    if(fd < 0 || (slot = uring_slot(ring, fd)) == NULL) {
+        errno = fd < 0 ? EBADF : ENOMEM;
+        return -1;
+    }
+
+    if(slot->armed && uring_prep_remove(ring, uring_udata(slot->gen, fd)) < 0) {
+        return -1;
+    }
+    slot->armed = 0;
+
+    /* completions still queued for the old registration are stale now */
+    slot->gen = (slot->gen + 1) & URING_GEN_MASK;
+    if(slot->gen == 0) {
+        slot->gen = 1;
+    }
+
+    if(op == EPOLL_CTL_DEL) {
+        slot->data = 0;
+        return 0;
+    }
+
+    slot->events = events;
+    slot->data = data;
+    if(uring_prep_poll(ring, fd, events, uring_udata(slot->gen, fd), !(events & EPOLLONESHOT)) < 0) {
+        return -1;
+    }
+    slot->armed = 1;
+
+    return 0;
+}
+
+/* on the owner: apply what other threads posted, oldest first */
+static void uring_apply_posted(uring_t *ring) {
+    uring_op_t *op, *prev = NULL, *next;
+
+    op = __atomic_exchange_n(&ring->posted, NULL, __ATOMIC_ACQUIRE);
+
+    /* the stack is newest first */
+    for(; op; op = next) {
+        next = op->next;
+        op->next = prev;
+        prev = op;
+    }
+
+    for(op = prev; op; op = next) {
+        next = op->next;
+        if(uring_apply(ring, op->op, op->fd, op->events, op->data) < 0) {
+            perror("uring ctl error");
+        }
+        tc_free(op);
+    }
+}
+
+static int uring_post(uring_t *ring, int op, int fd, struct epoll_event *event) {
+    uring_op_t *o, *head;
+
+    o = (uring_op_t *)tc_malloc(sizeof(uring_op_t));
+    if(o == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    o->op = op;
+    o->fd = fd;
+    o->events = event ? event->events : 0;
+    o->data = event ? event->data.u64 : 0;
+
+    head = __atomic_load_n(&ring->posted, __ATOMIC_RELAXED);
+    do {
+        o->next = head;
+    } while(!__atomic_compare_exchange_n(&ring->posted, &head, o, 1,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    /* only the first poster wakes the owner */
+    if(__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST)
+        && __atomic_exchange_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        eventfd_write(ring->wakefd, 1);
+    }
+
+    return 0;
+}
+
+static int uring_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+    uring_t *ring = uring_lookup(epfd);
+
+    if(ring == NULL) {
+        return -1;
+    }
+
+    /* before the first wait the ring is set up by a single thread */
+    if(ring->owned && !pthread_equal(ring->owner, pthread_self())) {
+        return uring_post(ring, op, fd, event);
+    }
+
+    uring_apply_posted(ring);
+
+    return uring_apply(ring, op, fd, event ? event->events : 0, event ? event->data.u64 : 0);
+}
+
+static int uring_reap(uring_t *ring, struct epoll_event *events, int maxevents) {
+    struct io_uring_cqe *cqe;
+    uring_slot_t *slot;
+    uring_done_t *done;
+    unsigned head, tail;
+    eventfd_t value;
+    uint32_t fd;
+    int n = 0;
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    while(head != tail && n < maxevents) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        head++;
+
+        if(cqe->user_data == URING_UDATA_INTERNAL) {
+            continue;
+        }
+
+        if(cqe->user_data > URING_UDATA_WAKE && !(cqe->user_data & URING_UDATA_POLL)) {
+            done = &ring->done[n];
+            done->ring = ring;
+            done->io = (uring_io_t *)(uintptr_t)cqe->user_data;
+            done->res = cqe->res;
+            done->flags = cqe->flags;
+
+            events[n].events = URING_EPOLL_COMPLETION;
+            events[n].data.ptr = done;
+            n++;
+            continue;
+        }
+
+        if(cqe->user_data == URING_UDATA_WAKE) {
+            eventfd_read(ring->wakefd, &value);
+            if(!(cqe->flags & IORING_CQE_F_MORE)) {
+                uring_prep_poll(ring, ring->wakefd, EPOLLIN, URING_UDATA_WAKE, 1);
+            }
+            continue;
+        }
+
+        fd = (uint32_t)cqe->user_data;
+        if(fd >= (uint32_t)ring->nslots || ring->slots[fd].gen != uring_udata_gen(cqe->user_data)) {
+            /* removed or replaced since, the data may be freed */
+            continue;
+        }
+        slot = &ring->slots[fd];
+
+        if(!(cqe->flags & IORING_CQE_F_MORE)) {
+            slot->armed = 0;
+            /* a multishot poll was terminated by the kernel, arm it again */
+            if(!(slot->events & EPOLLONESHOT)
+                && uring_prep_poll(ring, fd, slot->events, cqe->user_data, 1) == 0) {
+                slot->armed = 1;
+            }
+        }
+
+        if(cqe->res < 0) {
+            continue;
+        }
+
+        events[n].events = (uint32_t)cqe->res;
+        events[n].data.u64 = slot->data;
+        n++;
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+static int uring_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+    uring_t *ring = uring_lookup(epfd);
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    int n, ret;
+
+    if(ring == NULL) {
+        return -1;
+    }
+
+    if(!ring->owned) {
+        ring->owner = pthread_self();
+        ring->owned = 1;
+    }
+
+    /* every event may be a completion */
+    if(ring->br && ring->ndone < maxevents) {
+        uring_done_t *done = (uring_done_t *)tc_realloc(ring->done, maxevents * sizeof(uring_done_t));
+        if(done == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ring->done = done;
+        ring->ndone = maxevents;
+    }
+
+    uring_apply_posted(ring);
+
+    n = uring_reap(ring, events, maxevents);
+    if(n > 0) {
+        /* do not block, but still push the queued requests */
+        uring_submit(ring);
+        return n;
+    }
+
+    /* posters look at sleeping after they push, so one of us sees the other */
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ring->posted, __ATOMIC_SEQ_CST) != NULL) {
+        __atomic_store_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST);
+        uring_apply_posted(ring);
+        timeout = 0;
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    if(timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    ret = io_uring_enter(ring->fd, ring->sq_pending, 1,
+                            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    __atomic_store_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST);
+    if(ret >= 0) {
+        ring->sq_pending -= ret;
+    } else if(errno != ETIME && errno != EINTR) {
+        return -1;
+    }
+
+    return uring_reap(ring, events, maxevents);
+}
+
+/*
+*   completion io, on the owner only. Buffer rings and multishot accept
+*   both came with 5.19, a ring that takes the buffer ring takes the rest
+*/
+int uring_io_init(int epfd) {
+    uring_t *ring = uring_lookup(epfd);
+    struct io_uring_buf_reg reg;
+    size_t size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    void *br;
+    int i;
+
+    if(ring == NULL) {
+        return -1;
+    }
+
+    br = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(br == MAP_FAILED) {
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = 0;
+    if(io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(br, size);
+        return -1;
+    }
+
+    ring->bufs = (char *)mmap(NULL, (size_t)URING_BUF_COUNT * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->bufs == MAP_FAILED) {
+        ring->bufs = NULL;
+        io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(br, size);
+        return -1;
+    }
+
+    ring->br = (struct io_uring_buf_ring *)br;
+    for(i = 0; i < URING_BUF_COUNT; i++) {
+        ring->br->bufs[i].addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)i * URING_BUF_SIZE);
+        ring->br->bufs[i].len = URING_BUF_SIZE;
+        ring->br->bufs[i].bid = i;
+    }
+    ring->br_tail = URING_BUF_COUNT;
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static void uring_buf_recycle(uring_t *ring, int bid) {
+    struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (URING_BUF_COUNT - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    ring->br_tail++;
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+int uring_reserve(int epfd, int n) {
+    uring_t *ring = uring_lookup(epfd);
+
+    if(ring == NULL) {
+        return -1;
+    }
+
+    if(*ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + n > *ring->sq_entries
+        && uring_submit(ring) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct io_uring_sqe *uring_io_sqe(uring_t *ring, int opcode, int fd, uring_io_t *io) {
+    struct io_uring_sqe *sqe;
+
+    if(ring == NULL || (sqe = uring_get_sqe(ring)) == NULL) {
+        return NULL;
+    }
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t)(uintptr_t)io;
+
+    return sqe;
+}
+
+/* blocking sockets: a splice to them waits in the kernel, not on EAGAIN */
+int uring_accept(int epfd, int fd, uring_io_t *io) {
+    uring_t *ring = uring_lookup(epfd);
+    struct io_uring_sqe *sqe = uring_io_sqe(ring, IORING_OP_ACCEPT, fd, io);
+    if(sqe == NULL) {
+        return -1;
+    }
+
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+
+    uring_commit_sqe(ring);
+    return 0;
+}
+
+int uring_recv(int epfd, int fd, size_t len, uring_io_t *io) {
+    uring_t *ring = uring_lookup(epfd);
+    struct io_uring_sqe *sqe = uring_io_sqe(ring, IORING_OP_RECV, fd, io);
+    if(sqe == NULL) {
+        return -1;
+    }
+
+    sqe->len = len < URING_BUF_SIZE ? len : URING_BUF_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+
+    uring_commit_sqe(ring);
+    return 0;
+}
+
+int uring_sendmsg(int epfd, int fd, struct msghdr *msg, int flags, int link, uring_io_t *io) {
+    uring_t *ring = uring_lookup(epfd);
+    struct io_uring_sqe *sqe = uring_io_sqe(ring, IORING_OP_SENDMSG, fd, io);
+    if(sqe == NULL) {
+        return -1;
+    }
+
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    if(link) {
+        sqe->flags = IOSQE_IO_LINK;
+    }
+
+    uring_commit_sqe(ring);
+    return 0;
+}
+
+int uring_splice(int epfd, int fd_in, int64_t off_in, int fd_out, size_t len,
+                 unsigned flags, int link, uring_io_t *io) {
+    uring_t *ring = uring_lookup(epfd);
+    struct io_uring_sqe *sqe = uring_io_sqe(ring, IORING_OP_SPLICE, fd_out, io);
+    if(sqe == NULL) {
+        return -1;
+    }
+
+    sqe->splice_fd_in = fd_in;
+    sqe->splice_off_in = (uint64_t)off_in;
+    sqe->off = (uint64_t)-1;
+    sqe->len = len;
+    sqe->splice_flags = flags;
+    if(link) {
+        sqe->flags = IOSQE_IO_LINK;
+    }
+
+    uring_commit_sqe(ring);
+    return 0;
+}
+
+void uring_complete(void *ptr) {
+    uring_done_t *done = (uring_done_t *)ptr;
+    uring_t *ring = done->ring;
+    uring_io_t *io = done->io;
+    int bid = -1;
+
+    io->buf = NULL;
+    if(done->flags & IORING_CQE_F_BUFFER) {
+        bid = done->flags >> IORING_CQE_BUFFER_SHIFT;
+        io->buf = ring->bufs + (size_t)bid * URING_BUF_SIZE;
+    }
+
+    /* io may be freed by the handler */
+    io->handler(io, done->res, done->flags);
+
+    if(bid >= 0) {
+        uring_buf_recycle(ring, bid);
+    }
+}
+
+event_backend_t uring_backend = {
+    "io_uring",
+    uring_create,
+    uring_ctl,
+    uring_wait
+};
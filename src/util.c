@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -102,12 +103,13 @@ int Listen(int fd, int backlog) {
 }
 
 
+/* -1 with errno EAGAIN when a non blocking fd is full, the caller waits for it */
 ssize_t Write(int fd, const void *buffer, size_t len) {
     ssize_t n;
     while((n = write(fd, buffer, len)) < 0)
     {
         if(errno == EINTR) continue;
-        perror("write error");
+        if(errno != EAGAIN) perror("write error");
         return -1;
     }
     return n;
@@ -125,10 +127,10 @@ size_t Writev(int fd, const struct iovec* iov, int count) {
 }
 
 ssize_t Read(int fd, void *buffer, size_t len) {
-    size_t n;
+    ssize_t n;
     while((n = read(fd, buffer, len)) < 0) {
         if(errno == EINTR) continue;
-        perror("read error");
+        if(errno != EAGAIN) perror("read error");
         return -1;
     }
     return n;
@@ -171,7 +173,7 @@ ssize_t Readn(int fd, void *vptr, size_t n)
 }
 
 
-int open_listenfd(int port) 
+int open_listenfd(int port, int reuseport) 
 {
     if (port <= 0) {
         port = 3000;
@@ -189,6 +191,12 @@ int open_listenfd(int port)
 		   (const void *)&optval , sizeof(int)) < 0)
 	    return -1;
 
+    /* Every reactor binds its own socket to the port, the kernel balances
+       incoming connections among them */
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+		   (const void *)&optval , sizeof(int)) < 0)
+	    return -1;
+
     /* Listenfd will be an endpoint for all requests to port
        on any IP address for this host */
     bzero((char *) &serveraddr, sizeof(serveraddr));
@@ -245,6 +253,11 @@ int read_conf(char *filename, conf_t *cf, char *buf, int len) {
     char *cur_pos = buf+pos;
 
     while (fgets(cur_pos, len-pos, fp)) {
+        /* comments, they do not keep their space in buf */
+        if (cur_pos[0] == '#') {
+            continue;
+        }
+
         delim_pos = strstr(cur_pos, DELIM);
         line_len = strlen(cur_pos);
         
@@ -286,6 +299,63 @@ int read_conf(char *filename, conf_t *cf, char *buf, int len) {
             cf->logdir = delim_pos + 1;
         }
 
+        if (strncmp("multireactor", cur_pos, 12) == 0) {
+            cf->multi_reactor = atoi(delim_pos + 1);
+        }
+
+        if (strncmp("backend", cur_pos, 7) == 0) {
+            cf->backend = delim_pos + 1;
+        }
+
+        if (strncmp("schedule", cur_pos, 8) == 0) {
+            cf->schedule = delim_pos + 1;
+        }
+
+        if (strncmp("queuepower", cur_pos, 10) == 0) {
+            cf->queue_power = atoi(delim_pos + 1);
+        }
+
+        if (strncmp("timer", cur_pos, 5) == 0) {
+            cf->timer = delim_pos + 1;
+        }
+
+        if (strncmp("maxbody", cur_pos, 7) == 0) {
+            cf->max_body = atol(delim_pos + 1);
+        }
+
+        if (strncmp("openfiles", cur_pos, 9) == 0) {
+            cf->open_files = delim_pos + 1;
+        }
+
+        if (strncmp("openfilevalid", cur_pos, 13) == 0) {
+            cf->open_file_valid = atoi(delim_pos + 1);
+        }
+
+        if (strncmp("hotcache", cur_pos, 8) == 0) {
+            cf->hot_cache = delim_pos + 1;
+        }
+
+        if (strncmp("hotfilemax", cur_pos, 10) == 0) {
+            cf->hot_file_max = atol(delim_pos + 1);
+        }
+
+        /* "gzip" is a prefix of the other gzip keys */
+        if (strncmp("gzip=", cur_pos, 5) == 0) {
+            cf->gzip = delim_pos + 1;
+        }
+
+        if (strncmp("gzipstatic", cur_pos, 10) == 0) {
+            cf->gzip_static = delim_pos + 1;
+        }
+
+        if (strncmp("gzipcache", cur_pos, 9) == 0) {
+            cf->gzip_cache = atol(delim_pos + 1);
+        }
+
+        if (strncmp("mimetypes", cur_pos, 9) == 0) {
+            cf->mime_types = delim_pos + 1;
+        }
+
         cur_pos += line_len;
     }
 
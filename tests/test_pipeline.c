@@ -0,0 +1,209 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <gperftools/tcmalloc.h>
+
+#include "http.h"
+#include "http_request.h"
+#include "http_gzip.h"
+#include "http_mime.h"
+#include "file_cache.h"
+#include "epoll.h"
+#include "timer.h"
+#include "clock.h"
+#include "ring_log.h"
+#include "util.h"
+
+/*
+*   pipelined requests through handle_read and handle_write on one end of
+*   a socketpair. A HEAD followed by a GET must come back as two responses
+*   where the second starts right after the headers of the first, for the
+*   plain file, its gzip variant and ranges of it.
+*
+*   make test, from the top of the tree: the files are served from ./html
+*/
+
+#define TEST_FILE       "/index.html"
+
+conf_t cf;
+char conf_buf[BUFLEN];
+
+static int test_epfd;
+static timer_shard_t test_shard;
+
+typedef struct test_case_s {
+    const char *name;
+    const char *head;       /* headers of the HEAD request */
+} test_case_t;
+
+static test_case_t test_cases[] = {
+    { "identity",   "" },
+    { "gzip",       "Accept-Encoding: gzip\r\n" },
+    { "range",      "Range: bytes=0-9\r\n" },
+    { "ranges",     "Range: bytes=0-9,20-29\r\n" },
+    { "not found",  "" },
+    { NULL, NULL }
+};
+
+/* length of the response at p: headers and Content-length bytes, 0 if it is not one */
+static size_t test_response(const char *p, size_t len, size_t *body) {
+    const char *end, *cl;
+
+    if (len < 9 || strncmp(p, "HTTP/1.1 ", 9) != 0) {
+        return 0;
+    }
+
+    end = memmem(p, len, "\r\n\r\n", 4);
+    if (end == NULL) {
+        return 0;
+    }
+
+    cl = memmem(p, end - p, "\r\nContent-length: ", sizeof("\r\nContent-length: ") - 1);
+    if (cl == NULL) {
+        return 0;
+    }
+
+    *body = strtoul(cl + sizeof("\r\nContent-length: ") - 1, NULL, 10);
+
+    return end + 4 - p;
+}
+
+/* the responses of the HEAD and the GET on one connection, -1 if the framing is broken */
+static int test_run(test_case_t *t) {
+    http_request_t *request;
+    struct epoll_event event;
+    char req[1024], buf[65536];
+    const char *uri = strcmp(t->name, "not found") == 0 ? "/missing.html" : TEST_FILE;
+    size_t len = 0, head_len, head_body, get_len, get_body;
+    ssize_t n;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+    set_socket_non_blocking(sv[0]);
+
+    request = (http_request_t *)tc_malloc(sizeof(http_request_t));
+    init_request_t(request, sv[0], test_epfd, &cf);
+    request->buf = http_ring_alloc();
+    request->timer_shard = &test_shard;
+
+    event.data.ptr = request;
+    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    event_add_timer(request, TIMEOUT_DEFAULT);
+    Epoll_Add(test_epfd, sv[0], &event);
+
+    n = snprintf(req, sizeof(req),
+                 "HEAD %s HTTP/1.1\r\nHost: test\r\nConnection: keep-alive\r\n%s\r\n"
+                 "GET %s HTTP/1.1\r\nHost: test\r\nConnection: keep-alive\r\n\r\n",
+                 uri, t->head, uri);
+    if (write(sv[1], req, n) != n) {
+        perror("write");
+        return -1;
+    }
+
+    handle_read(request);
+    if (request->conn_state != HTTP_CONN_WRITE) {
+        printf("%-10s the requests are not parsed\n", t->name);
+        return -1;
+    }
+
+    /* answers both, the error of "not found" closes the connection after the HEAD */
+    handle_write(request);
+
+    set_socket_non_blocking(sv[1]);
+    while ((n = read(sv[1], buf + len, sizeof(buf) - len)) > 0) {
+        len += n;
+    }
+    close(sv[1]);
+
+    head_len = test_response(buf, len, &head_body);
+    if (head_len == 0) {
+        printf("%-10s no response to HEAD\n", t->name);
+        return -1;
+    }
+
+    if (strcmp(t->name, "not found") == 0) {
+        if (head_len != len) {
+            printf("%-10s %zu bytes after the headers of a failed HEAD\n", t->name, len - head_len);
+            return -1;
+        }
+        printf("%-10s ok\n", t->name);
+        return 0;
+    }
+
+    /* the GET follows the headers of the HEAD, not its body */
+    get_len = test_response(buf + head_len, len - head_len, &get_body);
+    if (get_len == 0) {
+        printf("%-10s the GET response does not follow the HEAD headers: %.*s\n",
+               t->name, 16, buf + head_len);
+        return -1;
+    }
+
+    if (head_len + get_len + get_body != len) {
+        printf("%-10s %zu bytes read, %zu expected\n", t->name, len, head_len + get_len + get_body);
+        return -1;
+    }
+
+    if (head_body == 0) {
+        printf("%-10s HEAD without Content-length of the body\n", t->name);
+        return -1;
+    }
+
+    /* a 206 varies with Accept-Encoding like the 200 of the same file */
+    if (strncmp(t->name, "range", 5) == 0
+        && memmem(buf, head_len, "\r\nVary: Accept-Encoding\r\n",
+                  sizeof("\r\nVary: Accept-Encoding\r\n") - 1) == NULL) {
+        printf("%-10s no Vary: Accept-Encoding in %.*s\n", t->name, (int)head_len, buf);
+        return -1;
+    }
+
+    /* Keep-Alive counts seconds */
+    if (memmem(buf + head_len, get_len, "\r\nKeep-Alive: timeout=300\r\n",
+               sizeof("\r\nKeep-Alive: timeout=300\r\n") - 1) == NULL) {
+        printf("%-10s no Keep-Alive: timeout=300 in %.*s\n", t->name, (int)get_len, buf + head_len);
+        return -1;
+    }
+
+    printf("%-10s ok\n", t->name);
+
+    /* the connection waits for the next request */
+    http_close_conn(request);
+
+    return 0;
+}
+
+int main(void) {
+    int failed = 0;
+
+    cf.root = "./html";
+
+    LOG_INIT("./log", "test_pipeline", ERROR);
+    clock_init();
+    event_timer_init(EVENT_TIMER_RBTREE);
+    http_gzip_init(1, 1, HTTP_GZIP_CACHE_DEFAULT);
+
+    test_epfd = Epoll_Create(0);
+    if (test_epfd < 0 || event_timer_shard_init(&test_shard, test_epfd) < 0) {
+        return 1;
+    }
+    timer_shard_self = &test_shard;
+
+    if (http_mime_init(NULL) < 0
+        || file_cache_init(FILE_CACHE_MAX_DEFAULT, FILE_CACHE_VALID_DEFAULT, cf.root,
+                           FILE_CACHE_HOT_DEFAULT, FILE_CACHE_HOT_FILE_DEFAULT) < 0) {
+        printf("init error\n");
+        return 1;
+    }
+
+    for (int i = 0; test_cases[i].name != NULL; i++) {
+        if (test_run(&test_cases[i]) < 0) {
+            failed++;
+        }
+    }
+
+    return failed ? 1 : 0;
+}
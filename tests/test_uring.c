@@ -0,0 +1,224 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <gperftools/tcmalloc.h>
+
+#include "http.h"
+#include "http_request.h"
+#include "http_uring.h"
+#include "http_gzip.h"
+#include "http_mime.h"
+#include "file_cache.h"
+#include "epoll.h"
+#include "uring.h"
+#include "timer.h"
+#include "clock.h"
+#include "ring_log.h"
+#include "util.h"
+
+/*
+*   a connection served on an io_uring ring the way a reactor does it: the
+*   multishot accept, recv into provided buffers, and the responses as
+*   linked sendmsg and splice requests. The hot cache is off, so the bodies
+*   are spliced from the file. A HEAD, a GET and a GET of two ranges are
+*   pipelined, the last one without keep-alive closes the connection.
+*
+*   make test, from the top of the tree: the files are served from ./html.
+*   Skipped on kernels without multishot accept and buffer rings (5.19)
+*/
+
+#define TEST_FILE       "/index.html"
+#define TEST_LOOPS      200
+
+conf_t cf;
+char conf_buf[BUFLEN];
+
+static timer_shard_t test_shard;
+
+/* length of the headers at p and the Content-length they announce, 0 if it is not a response */
+static size_t test_response(const char *p, size_t len, size_t *body) {
+    const char *end, *cl;
+
+    end = memmem(p, len, "\r\n\r\n", 4);
+    if (len < 9 || strncmp(p, "HTTP/1.1 ", 9) != 0 || end == NULL) {
+        return 0;
+    }
+
+    cl = memmem(p, end - p, "\r\nContent-length: ", sizeof("\r\nContent-length: ") - 1);
+    if (cl == NULL) {
+        return 0;
+    }
+
+    *body = strtoul(cl + sizeof("\r\nContent-length: ") - 1, NULL, 10);
+
+    return end + 4 - p;
+}
+
+static int test_listen(int *port) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0
+        || getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+        perror("listen");
+        return -1;
+    }
+    set_socket_non_blocking(fd);
+
+    *port = ntohs(addr.sin_port);
+
+    return fd;
+}
+
+static int test_connect(int port) {
+    struct sockaddr_in addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        return -1;
+    }
+    set_socket_non_blocking(fd);
+
+    return fd;
+}
+
+int main(void) {
+    http_request_t *listen_request;
+    struct epoll_event events[64];
+    char req[1024], buf[65536], file[4096];
+    size_t len = 0, head_len, head_body, get_len, get_body, range_len, range_body, file_len;
+    ssize_t n;
+    int epfd, listenfd, fd, port, eof = 0, fail = 0;
+
+    cf.root = "./html";
+
+    LOG_INIT("./log", "test_uring", ERROR);
+    clock_init();
+    event_timer_init(EVENT_TIMER_RBTREE);
+    http_gzip_init(0, 0, HTTP_GZIP_CACHE_DEFAULT);
+
+    if (http_mime_init(NULL) < 0
+        || file_cache_init(FILE_CACHE_MAX_DEFAULT, FILE_CACHE_VALID_DEFAULT, cf.root,
+                           0, FILE_CACHE_HOT_FILE_DEFAULT) < 0) {
+        printf("init error\n");
+        return 1;
+    }
+
+    fd = open("./html" TEST_FILE, O_RDONLY);
+    if (fd < 0 || (n = read(fd, file, sizeof(file))) <= 0) {
+        perror("./html" TEST_FILE);
+        return 1;
+    }
+    file_len = n;
+    close(fd);
+
+    if (event_backend_select("io_uring") < 0 || (epfd = Epoll_Create(0)) < 0) {
+        printf("no io_uring, skipped\n");
+        return 0;
+    }
+
+    if (event_timer_shard_init(&test_shard, epfd) < 0) {
+        return 1;
+    }
+    timer_shard_self = &test_shard;
+
+    listenfd = test_listen(&port);
+    if (listenfd < 0) {
+        return 1;
+    }
+
+    listen_request = (http_request_t *)tc_malloc(sizeof(http_request_t));
+    init_request_t(listen_request, listenfd, epfd, &cf);
+    listen_request->timer_shard = &test_shard;
+
+    if (http_uring_listen(listen_request) < 0) {
+        printf("no completion io on this kernel, skipped\n");
+        return 0;
+    }
+
+    fd = test_connect(port);
+    if (fd < 0) {
+        return 1;
+    }
+
+    n = snprintf(req, sizeof(req),
+                 "HEAD %s HTTP/1.1\r\nHost: test\r\nConnection: keep-alive\r\n\r\n"
+                 "GET %s HTTP/1.1\r\nHost: test\r\nConnection: keep-alive\r\n\r\n"
+                 "GET %s HTTP/1.1\r\nHost: test\r\nRange: bytes=0-9,20-29\r\n\r\n",
+                 TEST_FILE, TEST_FILE, TEST_FILE);
+    if (write(fd, req, n) != n) {
+        perror("write");
+        return 1;
+    }
+
+    /* the loop of a reactor, until the server closes the connection */
+    for (int loop = 0; loop < TEST_LOOPS && !eof; loop++) {
+        n = Epoll_Wait(epfd, events, 64, 10);
+        clock_update();
+        event_process_posted();
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].events & URING_EPOLL_COMPLETION) {
+                uring_complete(events[i].data.ptr);
+            }
+        }
+
+        while ((n = read(fd, buf + len, sizeof(buf) - len)) > 0) {
+            len += n;
+        }
+        eof = n == 0;
+    }
+    close(fd);
+
+    if (!eof) {
+        printf("the connection is not closed after the last response\n");
+        return 1;
+    }
+
+    head_len = test_response(buf, len, &head_body);
+    get_len = head_len ? test_response(buf + head_len, len - head_len, &get_body) : 0;
+    range_len = get_len ? test_response(buf + head_len + get_len + get_body,
+                                        len - head_len - get_len - get_body, &range_body) : 0;
+
+    if (range_len == 0) {
+        printf("%zu bytes are not three responses: %.*s\n", len, (int)len, buf);
+        return 1;
+    }
+
+    if (head_body != file_len || get_body != file_len
+        || memcmp(buf + head_len + get_len, file, file_len) != 0) {
+        printf("the GET does not carry the %zu bytes of the file\n", file_len);
+        fail++;
+    }
+
+    if (strncmp(buf + head_len + get_len + get_body, "HTTP/1.1 206", 12) != 0
+        || head_len + get_len + get_body + range_len + range_body != len
+        || memmem(buf + len - range_body, range_body, file, 10) == NULL
+        || memmem(buf + len - range_body, range_body, file + 20, 10) == NULL) {
+        printf("the ranges are not answered: %.*s\n", (int)(len - head_len - get_len - get_body),
+               buf + head_len + get_len + get_body);
+        fail++;
+    }
+
+    printf("uring      %s\n", fail ? "failed" : "ok");
+
+    return fail ? 1 : 0;
+}